@@ -1,65 +1,1743 @@
-//Compile - g++ -std=c++11 -O3 -mtune=native -Wall -pedantic -pthread main.cpp -lboost_system -lboost_thread && ./a.out
+//Compile - g++ -std=c++20 -O3 -mtune=native -Wall -pedantic -pthread main.cpp -lboost_system -lboost_thread -lboost_chrono && ./a.out
+// add -DACTOR_METRICS=1 for per-actor queue depth, latency histograms and snapshotActors()
 // run it on rohanverma.godbolt.org
 
 #include <boost/thread/thread.hpp>
 #include <boost/thread/future.hpp>
 #include <boost/function.hpp>
 #include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
 #include <iostream>
 #include <string>
 #include <cassert>
+#include <algorithm>
+#include <climits>
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <stdexcept>
+#include <memory>
+#include <new>
+#include <optional>
 #include <queue>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cpuid.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#ifndef ACTOR_METRICS
+#define ACTOR_METRICS 0
+#endif
 
 using namespace boost;
 
-struct Actor
+// Futex on a 32-bit atomic, the kernel only sleeps if *addr still equals expected
+inline void futexWait(atomic<uint32_t>& word, uint32_t expected)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void futexWake(atomic<uint32_t>& word, int count)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+// Pins the calling thread to the given cpus, false if the kernel refused
+inline bool pinThread(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i != cpus.size(); ++i) CPU_SET(cpus[i], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Cpus of a NUMA node, read from its sysfs cpulist such as "0-3,8-11"
+inline std::vector<int> cpusOfNode(int node)
+{
+    std::vector<int> cpus;
+    std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    int first, last;
+    char sep;
+    while (in >> first)
+    {
+        last = first;
+        if (in.peek() == '-') in >> sep >> last;
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        if (in.peek() == ',') in >> sep;
+    }
+    return cpus;
+}
+
+// Makes the pages of [p, p + bytes) prefer a NUMA node, false if the kernel
+// refused, as it does for unknown nodes or without NUMA support. The kernel
+// reads maxnode - 1 bits of the mask, hence the extra one
+inline bool preferNode(void* p, size_t bytes, int node)
+{
+    const size_t bits = sizeof(unsigned long) * CHAR_BIT;
+    std::vector<unsigned long> mask(node / bits + 1, 0);
+    mask[node / bits] = 1ul << (node % bits);
+    return syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1, 0) == 0;
+}
+
+// n default-constructed Ts whose pages prefer a NUMA node, node -1 is a
+// plain new[]. Placement is best effort, when preferNode is refused the
+// items live on ordinary pages
+template <class T>
+T* newOnNode(size_t n, int node)
+{
+    if (node < 0) return new T[n];
+    void* p = mmap(nullptr, n * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    preferNode(p, n * sizeof(T), node);
+    T* items = static_cast<T*>(p);
+    for (size_t i = 0; i != n; ++i) new (&items[i]) T();
+    return items;
+}
+
+template <class T>
+void deleteOnNode(T* items, size_t n, int node)
+{
+    if (node < 0) { delete[] items; return; }
+    for (size_t i = 0; i != n; ++i) items[i].~T();
+    munmap(items, n * sizeof(T));
+}
+
+// umonitor/umwait, where the cpu has them: a thread can sleep in a light
+// power state until a watched cache line is written or a TSC deadline passes
+inline bool hasWaitpkg()
+{
+    static const bool has = []
+    {
+        unsigned a, b, c, d;
+        return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (c & (1u << 5));
+    }();
+    return has;
+}
+
+__attribute__((target("waitpkg"))) inline void monitorWord(const void* word)
+{
+    _umonitor(const_cast<void*>(word));
+}
+
+__attribute__((target("waitpkg"))) inline void waitOnMonitor(uint64_t tscDeadline)
+{
+    _umwait(0, tscDeadline);
+}
+
+// Eventcount for the single consumer : the worker announces itself before its
+// final check of the queue, so producers skip the syscall while it is awake,
+// and only the producer that flips PARKED back to AWAKE pays for the wakeup
+class EventCount
+{
+    enum { AWAKE, PARKED };
+    atomic<uint32_t> d_state;
+
+public:
+    EventCount() : d_state(AWAKE) {}
+
+    void prepareWait()
+    {
+        d_state.store(PARKED, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+
+    void cancelWait() { d_state.store(AWAKE, memory_order_relaxed); }
+
+    void commitWait()
+    {
+        while (d_state.load(memory_order_acquire) == PARKED) futexWait(d_state, PARKED);
+    }
+
+    // True if this call woke the waiter
+    bool notify()
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (d_state.load(memory_order_relaxed) != PARKED
+            || d_state.exchange(AWAKE, memory_order_acq_rel) != PARKED)
+            return false;
+        futexWake(d_state, 1);
+        return true;
+    }
+};
+
+// Intrusive multi-producer single-consumer queue (Vyukov). Producers swing
+// d_head with one exchange, the consumer follows d_next links from d_tail.
+// Mail nodes queue in actor mailboxes, actors themselves in worker inboxes
+struct MpscNode
+{
+    atomic<MpscNode*> d_next;
+};
+
+class MpscQueue
+{
+    atomic<MpscNode*> d_head;
+    MpscNode* d_tail;
+    MpscNode d_stub;
+
+public:
+    MpscQueue() : d_head(&d_stub), d_tail(&d_stub) { d_stub.d_next.store(nullptr, memory_order_relaxed); }
+
+    // first .. last must already be linked, the whole chain goes in with one exchange
+    void push(MpscNode* first, MpscNode* last)
+    {
+        last->d_next.store(nullptr, memory_order_relaxed);
+        MpscNode* prev = d_head.exchange(last, memory_order_acq_rel);
+        prev->d_next.store(first, memory_order_release);
+    }
+
+    void push(MpscNode* node) { push(node, node); }
+
+    // Written by every push, for a consumer watching the queue with umonitor
+    const void* pushWord() const { return &d_head; }
+
+    // Consumer only, null when empty or while a producer is between its
+    // exchange and its link
+    MpscNode* pop()
+    {
+        MpscNode* tail = d_tail;
+        MpscNode* next = tail->d_next.load(memory_order_acquire);
+        if (tail == &d_stub)
+        {
+            if (!next) return nullptr;
+            d_tail = tail = next;
+            next = next->d_next.load(memory_order_acquire);
+        }
+        if (next) { d_tail = next; return tail; }
+
+        if (tail != d_head.load(memory_order_acquire)) return nullptr;
+        push(&d_stub);
+
+        next = tail->d_next.load(memory_order_acquire);
+        if (next) { d_tail = next; return tail; }
+        return nullptr;
+    }
+};
+
+// Move-only int() callable kept entirely inline, captures that do not fit
+// are rejected at compile time rather than silently boxed on the heap
+template <std::size_t Capacity>
+class InlineJob
+{
+    struct Ops
+    {
+        int (*invoke)(void*);
+        void (*relocate)(void* from, void* to);
+        void (*destroy)(void*);
+    };
+
+    template <class F>
+    struct OpsFor
+    {
+        static int invoke(void* p) { return (*static_cast<F*>(p))(); }
+        static void relocate(void* from, void* to)
+        {
+            F* f = static_cast<F*>(from);
+            new (to) F(std::move(*f));
+            f->~F();
+        }
+        static void destroy(void* p) { static_cast<F*>(p)->~F(); }
+        static const Ops ops;
+    };
+
+    typedef typename std::aligned_storage<Capacity>::type Storage;
+
+    Storage d_storage;
+    const Ops* d_ops;
+
+public:
+    InlineJob() : d_ops(nullptr) {}
+
+    template <class F, class = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, InlineJob>::value>::type>
+    InlineJob(F&& f) : d_ops(nullptr) { emplace(std::forward<F>(f)); }
+
+    InlineJob(InlineJob&& other) : d_ops(nullptr) { *this = std::move(other); }
+
+    InlineJob& operator=(InlineJob&& other)
+    {
+        if (this == &other) return *this;
+        reset();
+        if (other.d_ops)
+        {
+            other.d_ops->relocate(&other.d_storage, &d_storage);
+            d_ops = other.d_ops;
+            other.d_ops = nullptr;
+        }
+        return *this;
+    }
+
+    InlineJob(const InlineJob&) = delete;
+    InlineJob& operator=(const InlineJob&) = delete;
+
+    ~InlineJob() { reset(); }
+
+    template <class F>
+    void emplace(F&& f)
+    {
+        typedef typename std::decay<F>::type Fn;
+        static_assert(sizeof(Fn) <= Capacity, "job capture does not fit the inline storage");
+        static_assert(alignof(Fn) <= alignof(Storage), "job capture is over-aligned");
+        reset();
+        new (&d_storage) Fn(std::forward<F>(f));
+        d_ops = &OpsFor<Fn>::ops;
+    }
+
+    void reset()
+    {
+        if (!d_ops) return;
+        d_ops->destroy(&d_storage);
+        d_ops = nullptr;
+    }
+
+    explicit operator bool() const { return d_ops != nullptr; }
+
+    int operator()() { return d_ops->invoke(&d_storage); }
+};
+
+template <std::size_t Capacity>
+template <class F>
+const typename InlineJob<Capacity>::Ops InlineJob<Capacity>::OpsFor<F>::ops =
+    { &OpsFor<F>::invoke, &OpsFor<F>::relocate, &OpsFor<F>::destroy };
+
+// Recycling slab of nodes, shared by many producers and the one consumer.
+// Nodes are addressed by a 32-bit index so the free list head packs an ABA
+// tag beside it in a single word. Slabs double in size, are only allocated
+// while the pool warms up and are released with the pool
+template <class Node>
+class NodePool
+{
+    enum { FIRST_SLAB = 8, MAX_SLABS = 28 };
+    static const uint32_t NIL = 0xffffffffu;
+
+    atomic<uint64_t> d_free;  // tag << 32 | index
+    atomic<Node*> d_slabs[MAX_SLABS];
+    uint32_t d_slabCount;
+    const int d_node;  // NUMA node of the slabs, -1 for none
+    mutex d_growMutex;
+
+    Node* at(uint32_t index) const
+    {
+        const uint32_t slab = 31 - __builtin_clz(index / FIRST_SLAB + 1);
+        const uint32_t first = FIRST_SLAB * ((1u << slab) - 1);
+        return d_slabs[slab].load(memory_order_acquire) + (index - first);
+    }
+
+    // Links first .. last in front of the current free list
+    void pushChain(Node* first, Node* last)
+    {
+        uint64_t head = d_free.load(memory_order_relaxed);
+        uint64_t next;
+        do
+        {
+            last->d_nextFree.store(uint32_t(head), memory_order_relaxed);
+            next = ((head >> 32) + 1) << 32 | first->d_index;
+        } while (!d_free.compare_exchange_weak(head, next, memory_order_release, memory_order_relaxed));
+    }
+
+    void grow()
+    {
+        lock_guard<mutex> g(d_growMutex);
+        if (uint32_t(d_free.load(memory_order_acquire)) != NIL) return;
+        if (d_slabCount == MAX_SLABS) throw std::bad_alloc();
+
+        const uint32_t slab = d_slabCount++;
+        const uint32_t size = FIRST_SLAB << slab, first = FIRST_SLAB * ((1u << slab) - 1);
+        Node* nodes = newOnNode<Node>(size, d_node);
+        for (uint32_t i = 0; i != size; ++i)
+        {
+            nodes[i].d_index = first + i;
+            nodes[i].d_nextFree.store(first + i + 1, memory_order_relaxed);
+        }
+        d_slabs[slab].store(nodes, memory_order_release);
+        pushChain(&nodes[0], &nodes[size - 1]);
+    }
+
+public:
+    explicit NodePool(int node = -1) : d_free(NIL), d_slabCount(0), d_node(node)
+    {
+        for (int i = 0; i != MAX_SLABS; ++i) d_slabs[i].store(nullptr, memory_order_relaxed);
+    }
+
+    ~NodePool()
+    {
+        for (uint32_t i = 0; i != d_slabCount; ++i)
+            deleteOnNode(d_slabs[i].load(memory_order_relaxed), size_t(FIRST_SLAB) << i, d_node);
+    }
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    // Takes n nodes off the free list, with a single CAS whenever that many
+    // are free, and hands them to visit in order. Indices read during the
+    // walk may be stale but are always NIL or a published slot, and the
+    // tagged CAS rejects any walk that raced with another thread
+    template <class Visit>
+    void acquire(uint32_t n, Visit visit)
+    {
+        while (n != 0)
+        {
+            uint64_t head = d_free.load(memory_order_acquire);
+            uint32_t taken, next;
+            for (;;)
+            {
+                if (uint32_t(head) == NIL)
+                {
+                    grow();
+                    head = d_free.load(memory_order_acquire);
+                    continue;
+                }
+                taken = 1;
+                next = at(uint32_t(head))->d_nextFree.load(memory_order_relaxed);
+                while (taken != n && next != NIL)
+                {
+                    next = at(next)->d_nextFree.load(memory_order_relaxed);
+                    ++taken;
+                }
+                if (d_free.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | next,
+                        memory_order_acquire, memory_order_acquire))
+                    break;
+            }
+
+            uint32_t index = uint32_t(head);
+            for (uint32_t i = 0; i != taken; ++i)
+            {
+                Node* node = at(index);
+                index = node->d_nextFree.load(memory_order_relaxed);
+                visit(node);
+            }
+            n -= taken;
+        }
+    }
+
+    Node* acquire()
+    {
+        Node* node = nullptr;
+        acquire(1, [&node](Node* n) { node = n; });
+        return node;
+    }
+
+    // Chains nodes for release, next goes back to the pool right after prev
+    static void link(Node* prev, Node* next) { prev->d_nextFree.store(next->d_index, memory_order_relaxed); }
+
+    void release(Node* first, Node* last) { pushChain(first, last); }
+
+    void release(Node* node) { pushChain(node, node); }
+};
+
+// Bounded multi-producer multi-consumer ring (Vyukov), preallocated. Each
+// cell's sequence number says whose turn it is, so a push or a pop is one
+// CAS on its position plus a release store on the cell
+template <class T>
+class BoundedRing
+{
+    struct Cell
+    {
+        atomic<size_t> d_seq;
+        T d_value;
+    };
+
+    const size_t d_mask;
+    const int d_node;
+    Cell* d_cells;
+    atomic<size_t> d_enqueue;
+    atomic<size_t> d_dequeue;
+
+public:
+    // Capacity is rounded up to a power of two, the cells prefer NUMA node
+    // node unless it is -1
+    explicit BoundedRing(size_t capacity, int node = -1)
+        : d_mask((size_t(1) << (64 - __builtin_clzll(std::max<size_t>(capacity, 2) - 1))) - 1),
+          d_node(node), d_cells(newOnNode<Cell>(d_mask + 1, node)), d_enqueue(0), d_dequeue(0)
+    {
+        for (size_t i = 0; i <= d_mask; ++i) d_cells[i].d_seq.store(i, memory_order_relaxed);
+    }
+
+    ~BoundedRing() { deleteOnNode(d_cells, d_mask + 1, d_node); }
+
+    BoundedRing(const BoundedRing&) = delete;
+    BoundedRing& operator=(const BoundedRing&) = delete;
+
+    // fill(T&) writes the value into the claimed cell, false when full
+    template <class Fill>
+    bool tryPush(Fill&& fill)
+    {
+        size_t pos = d_enqueue.load(memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = d_cells[pos & d_mask];
+            const intptr_t dif = intptr_t(cell.d_seq.load(memory_order_acquire)) - intptr_t(pos);
+            if (dif == 0)
+            {
+                if (d_enqueue.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    fill(cell.d_value);
+                    cell.d_seq.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (dif < 0) return false;
+            else pos = d_enqueue.load(memory_order_relaxed);
+        }
+    }
+
+    // take(T&) moves the value out of the claimed cell, false when empty
+    template <class Take>
+    bool tryPop(Take&& take)
+    {
+        size_t pos = d_dequeue.load(memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = d_cells[pos & d_mask];
+            const intptr_t dif = intptr_t(cell.d_seq.load(memory_order_acquire)) - intptr_t(pos + 1);
+            if (dif == 0)
+            {
+                if (d_dequeue.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    take(cell.d_value);
+                    cell.d_seq.store(pos + d_mask + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (dif < 0) return false;
+            else pos = d_dequeue.load(memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const { return d_mask + 1; }
+
+    // Approximate while pushes or pops are in flight
+    size_t size() const
+    {
+        const size_t dequeue = d_dequeue.load(memory_order_seq_cst);
+        const size_t enqueue = d_enqueue.load(memory_order_seq_cst);
+        return std::min(enqueue - std::min(enqueue, dequeue), capacity());
+    }
+};
+
+// What a caller waiting on a job sees when a full mailbox rejected or dropped it
+struct MailboxFull : std::runtime_error
+{
+    MailboxFull() : std::runtime_error("actor mailbox full") {}
+};
+
+// Rides inside a job whose caller is waiting on it; if the job is destroyed
+// without running, dropped from a full mailbox, onDrop tells the caller
+template <class OnDrop>
+class DropNotice
+{
+    OnDrop d_onDrop;
+    bool d_armed;
+
+public:
+    explicit DropNotice(OnDrop onDrop) : d_onDrop(onDrop), d_armed(true) {}
+    DropNotice(DropNotice&& other) : d_onDrop(other.d_onDrop), d_armed(std::exchange(other.d_armed, false)) {}
+    DropNotice(const DropNotice&) = delete;
+
+    ~DropNotice()
+    {
+        if (d_armed) d_onDrop();
+    }
+
+    void disarm() { d_armed = false; }
+};
+
+// Completion slot for one synchronous call, it lives on the caller's stack.
+// The caller spins briefly and then parks on the futex; the worker only
+// issues the wake syscall if the caller got as far as parking
+class SyncSlot
+{
+    enum { PENDING, PARKED, DONE };
+    enum { SPIN_LIMIT = 128 };
+
+    atomic<uint32_t> d_state;
+    int d_result;
+    std::exception_ptr d_error;
+
+public:
+    SyncSlot() : d_state(PENDING), d_result(0) {}
+
+    SyncSlot(const SyncSlot&) = delete;
+    SyncSlot& operator=(const SyncSlot&) = delete;
+
+    // Runs on the worker; the slot may be gone as soon as DONE is published
+    template <class F>
+    void run(F& job)
+    {
+        try { d_result = job(); }
+        catch (...) { d_error = std::current_exception(); }
+        complete();
+    }
+
+    void fail(std::exception_ptr error)
+    {
+        d_error = error;
+        complete();
+    }
+
+    void complete()
+    {
+        if (d_state.exchange(DONE, memory_order_acq_rel) == PARKED) futexWake(d_state, 1);
+    }
+
+    int wait()
+    {
+        for (int spin = 0; spin != SPIN_LIMIT && d_state.load(memory_order_acquire) == PENDING; ++spin)
+            __builtin_ia32_pause();
+
+        uint32_t state = PENDING;
+        if (d_state.compare_exchange_strong(state, PARKED, memory_order_acquire))
+            state = PARKED;
+        while (state == PARKED)
+        {
+            futexWait(d_state, PARKED);
+            state = d_state.load(memory_order_acquire);
+        }
+
+        if (d_error) std::rethrow_exception(d_error);
+        return d_result;
+    }
+};
+
+// Chase-Lev work-stealing deque of pointers. The owner pushes at the bottom;
+// everyone, the owner included, takes from the top, so ready actors run in
+// the order they became ready. Outgrown rings are kept until destruction
+// because a thief may still be reading one
+template <class T>
+class StealingDeque
+{
+    struct Ring
+    {
+        int64_t d_mask;
+        atomic<T>* d_slots;
+
+        explicit Ring(int64_t capacity) : d_mask(capacity - 1), d_slots(new atomic<T>[capacity]) {}
+        ~Ring() { delete[] d_slots; }
+
+        T get(int64_t i) const { return d_slots[i & d_mask].load(memory_order_relaxed); }
+        void put(int64_t i, T x) { d_slots[i & d_mask].store(x, memory_order_relaxed); }
+    };
+
+    atomic<int64_t> d_top;
+    atomic<int64_t> d_bottom;
+    atomic<Ring*> d_ring;
+    std::vector<Ring*> d_rings;
+
+public:
+    explicit StealingDeque(int64_t capacity = 256) : d_top(0), d_bottom(0), d_ring(new Ring(capacity))
+    {
+        d_rings.push_back(d_ring.load(memory_order_relaxed));
+    }
+
+    ~StealingDeque()
+    {
+        for (size_t i = 0; i != d_rings.size(); ++i) delete d_rings[i];
+    }
+
+    StealingDeque(const StealingDeque&) = delete;
+    StealingDeque& operator=(const StealingDeque&) = delete;
+
+    // Owner only
+    void push(T x)
+    {
+        const int64_t b = d_bottom.load(memory_order_relaxed), t = d_top.load(memory_order_acquire);
+        Ring* ring = d_ring.load(memory_order_relaxed);
+        if (b - t > ring->d_mask)
+        {
+            Ring* bigger = new Ring(2 * (ring->d_mask + 1));
+            for (int64_t i = t; i != b; ++i) bigger->put(i, ring->get(i));
+            d_rings.push_back(bigger);
+            d_ring.store(bigger, memory_order_release);
+            ring = bigger;
+        }
+        ring->put(b, x);
+        atomic_thread_fence(memory_order_release);
+        d_bottom.store(b + 1, memory_order_relaxed);
+    }
+
+    // Any thread, null when empty or when another taker won the race
+    T steal()
+    {
+        int64_t t = d_top.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        const int64_t b = d_bottom.load(memory_order_acquire);
+        if (t >= b) return T();
+
+        const T x = d_ring.load(memory_order_acquire)->get(t);
+        if (!d_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) return T();
+        return x;
+    }
+
+    bool empty() const
+    {
+        return d_top.load(memory_order_acquire) >= d_bottom.load(memory_order_acquire);
+    }
+};
+
+struct Actor;
+template <class T> class Call;
+class Task;
+
+// Placement and idle policy of a Scheduler's workers
+struct SchedulerOptions
+{
+    size_t threads = thread::hardware_concurrency();
+    std::vector<int> cpus;   // worker i is pinned to cpus[i % size], empty leaves workers unpinned
+    std::vector<int> nodes;  // without cpus, worker i is pinned to the cpus of NUMA node nodes[i % size]
+    uint32_t spinNanos = 0;  // longest an idle worker polls for work before it parks, 0 parks at once
+};
+
+// Fixed pool of worker threads running many actors. An actor that becomes
+// ready on a worker goes to that worker's deque; one made ready from any
+// other thread goes to a worker's inbox, dealt round-robin among the
+// workers on the actor's home node if it has one, and is moved to the
+// deque by its owner. Idle workers steal from each other's deques.
+// Latency-sensitive actors belong on a scheduler with a spin window, where
+// an idle worker polls before paying for a futex sleep and wakeup;
+// background actors stay on one that parks at once
+class Scheduler
+{
+    struct Worker
+    {
+        StealingDeque<Actor*> d_ready;
+        MpscQueue d_inbox;
+        EventCount d_wake;
+        Scheduler* d_owner;
+        thread* d_thread;
+        int d_node;        // NUMA node the worker is pinned to, -1 for none
+        uint32_t d_spin;   // current spin window, only touched by the worker
+
+        Worker(Scheduler* owner, int node, uint32_t spin)
+            : d_owner(owner), d_thread(nullptr), d_node(node), d_spin(spin) {}
+    };
+
+    // umwait slices while spinning, in TSC ticks, so a steal is noticed
+    // even though only the worker's own inbox is watched
+    enum { SPIN_SLICE_TICKS = 2000 };
+
+    const SchedulerOptions d_options;
+    std::vector<Worker*> d_workers;
+    atomic<uint32_t> d_sleepers;
+    atomic<uint32_t> d_nextInbox;
+    atomic<bool> d_running;
+
+    static thread_local Worker* s_worker;
+
+    static SchedulerOptions withThreads(size_t threads)
+    {
+        SchedulerOptions options;
+        options.threads = threads;
+        return options;
+    }
+
+    Actor* take(Worker& self, size_t selfIndex);
+    Actor* spin(Worker& self, size_t selfIndex);
+    Actor* findWork(Worker& self, size_t selfIndex);
+    Worker& inboxFor(int node);
+    void run(size_t index);
+
+    // Wakes one parked worker, if any, to come and steal
+    void wakeOne()
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (d_sleepers.load(memory_order_relaxed) == 0) return;
+        const size_t start = d_nextInbox.load(memory_order_relaxed);
+        for (size_t i = 0; i != d_workers.size(); ++i)
+            if (d_workers[(start + i) % d_workers.size()]->d_wake.notify()) return;
+    }
+
+public:
+    explicit Scheduler(size_t threads = thread::hardware_concurrency()) : Scheduler(withThreads(threads)) {}
+
+    explicit Scheduler(const SchedulerOptions& options)
+        : d_options(options), d_sleepers(0), d_nextInbox(0), d_running(true)
+    {
+        for (size_t i = 0; i != std::max<size_t>(1, options.threads); ++i)
+        {
+            const int node = options.cpus.empty() && !options.nodes.empty()
+                ? options.nodes[i % options.nodes.size()] : -1;
+            d_workers.push_back(new Worker(this, node, options.spinNanos));
+        }
+        for (size_t i = 0; i != d_workers.size(); ++i)
+            d_workers[i]->d_thread = new thread(&Scheduler::run, this, i);
+    }
+
+    // Actors on this scheduler must already be destroyed
+    ~Scheduler()
+    {
+        d_running.store(false);
+        for (size_t i = 0; i != d_workers.size(); ++i) d_workers[i]->d_wake.notify();
+        for (size_t i = 0; i != d_workers.size(); ++i) d_workers[i]->d_thread->join();
+        for (size_t i = 0; i != d_workers.size(); ++i)
+        {
+            delete d_workers[i]->d_thread;
+            delete d_workers[i];
+        }
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    static Scheduler& instance()
+    {
+        static Scheduler s;
+        return s;
+    }
+
+    size_t threads() const { return d_workers.size(); }
+
+    void schedule(Actor* actor);
+};
+
+// Per-actor metrics, compiled in with -DACTOR_METRICS=1. Switched off every
+// hook is an empty inline function and every stamp an empty member, so the
+// actor is exactly what it was without them
+template <bool Enabled>
+struct ActorMetrics
+{
+    struct Stamp {};
+
+    static Stamp now() { return Stamp(); }
+    static Stamp sample() { return Stamp(); }
+    void sent(uint32_t) {}
+    Stamp start(Stamp) { return Stamp(); }
+    void finish(Stamp) {}
+    void blocked(Stamp, Stamp) {}
+    void attach(Actor*) {}
+    void detach(Actor*) {}
+};
+
+// Switched on a stamp is one rdtsc, converted to nanoseconds only when a
+// snapshot is taken. Every job is counted but only one send in SAMPLE per
+// thread is stamped, and only stamped jobs are timed, which keeps the clock
+// reads off most jobs. An actor runs on one worker at a time, so its
+// histograms and job count have a single writer and take plain relaxed
+// stores; snapshots read them from any thread
+template <>
+struct ActorMetrics<true>
+{
+    typedef uint64_t Stamp;  // 0 for a job that is not timed
+
+    enum { SAMPLE = 32 };
+
+    // Log-linear buckets, four per power of two, so any value lands in a
+    // bucket within 25% of it
+    class Histogram
+    {
+        enum { SUB = 4, BUCKETS = SUB + (64 - 2) * SUB };
+        atomic<uint32_t> d_counts[BUCKETS];
+
+        static unsigned bucket(uint64_t v)
+        {
+            if (v < SUB) return v;
+            const unsigned e = 63 - __builtin_clzll(v);
+            return SUB + (e - 2) * SUB + ((v >> (e - 2)) & (SUB - 1));
+        }
+
+        static uint64_t lowest(unsigned b)
+        {
+            if (b < SUB) return b;
+            return uint64_t(SUB + (b - SUB) % SUB) << ((b - SUB) / SUB);
+        }
+
+    public:
+        Histogram() { for (unsigned b = 0; b != BUCKETS; ++b) d_counts[b].store(0, memory_order_relaxed); }
+
+        void record(uint64_t v)
+        {
+            atomic<uint32_t>& c = d_counts[bucket(v)];
+            c.store(c.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        }
+
+        // Lower bound of the bucket holding the q-th quantile, 0 when empty
+        uint64_t percentile(double q) const
+        {
+            uint64_t counts[BUCKETS], total = 0;
+            for (unsigned b = 0; b != BUCKETS; ++b) total += counts[b] = d_counts[b].load(memory_order_relaxed);
+            if (total == 0) return 0;
+            const uint64_t rank = std::max<uint64_t>(1, uint64_t(q * total + 0.5));
+            uint64_t seen = 0;
+            for (unsigned b = 0; b != BUCKETS; ++b)
+                if ((seen += counts[b]) >= rank) return lowest(b);
+            return lowest(BUCKETS - 1);
+        }
+    };
+
+    Histogram d_queued;  // send to start, ticks
+    Histogram d_run;     // start to finish, ticks
+    atomic<uint64_t> d_jobs;
+    atomic<uint32_t> d_peakDepth;
+    atomic<uint64_t> d_blockedSends;
+    atomic<uint64_t> d_blockedTicks;
+    uint64_t d_lastJobs;   // as of the previous snapshot, under the registry lock
+    Stamp d_lastStamp;
+
+    ActorMetrics() : d_jobs(0), d_peakDepth(0), d_blockedSends(0), d_blockedTicks(0), d_lastJobs(0), d_lastStamp(now()) {}
+
+    static Stamp now() { return __rdtsc(); }
+
+    static Stamp sample()
+    {
+        static thread_local uint32_t s_sends = 0;
+        return ++s_sends % SAMPLE == 0 ? now() : 0;
+    }
+
+    void sent(uint32_t depth)
+    {
+        uint32_t peak = d_peakDepth.load(memory_order_relaxed);
+        while (depth > peak && !d_peakDepth.compare_exchange_weak(peak, depth, memory_order_relaxed)) {}
+    }
+
+    // Stamps the start of a sampled job
+    Stamp start(Stamp sent)
+    {
+        if (!sent) return 0;
+        const Stamp t = now();
+        d_queued.record(t - sent);
+        return t;
+    }
+
+    void finish(Stamp start)
+    {
+        if (start) d_run.record(now() - start);
+        d_jobs.store(d_jobs.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    void blocked(Stamp t0, Stamp t1)
+    {
+        d_blockedSends.fetch_add(1, memory_order_relaxed);
+        d_blockedTicks.fetch_add(t1 - t0, memory_order_relaxed);
+    }
+
+    // Live actors, for snapshotActors
+    static mutex& registryMutex()
+    {
+        static mutex m;
+        return m;
+    }
+
+    static std::vector<Actor*>& registry()
+    {
+        static std::vector<Actor*> actors;
+        return actors;
+    }
+
+    void attach(Actor* actor)
+    {
+        epoch();
+        lock_guard<mutex> g(registryMutex());
+        registry().push_back(actor);
+    }
+
+    void detach(Actor* actor)
+    {
+        lock_guard<mutex> g(registryMutex());
+        std::vector<Actor*>& actors = registry();
+        actors.erase(std::find(actors.begin(), actors.end(), actor));
+    }
+
+    // Both clocks read when the first actor was built
+    static const std::pair<Stamp, chrono::steady_clock::time_point>& epoch()
+    {
+        static const std::pair<Stamp, chrono::steady_clock::time_point> e(now(), chrono::steady_clock::now());
+        return e;
+    }
+
+    // TSC rate measured against the steady clock since epoch()
+    static double nanosPerTick()
+    {
+        const chrono::duration<double, boost::nano> elapsed = chrono::steady_clock::now() - epoch().second;
+        return elapsed.count() / double(now() - epoch().first);
+    }
+};
+
+// Mailbox lanes, most urgent first. SYSTEM_LANE carries the actor's own
+// jobs, shutdown and coroutine resumption, and always drains first
+enum Lane { SYSTEM_LANE, HIGH_LANE, NORMAL_LANE, LOW_LANE, LANES };
+
+// No deadline, the job runs however long it waited
+typedef chrono::steady_clock::time_point Deadline;
+
+// Bound, overflow policy, lane weights and deadline policy of an actor's mailbox
+struct MailboxOptions
+{
+    enum Overflow
+    {
+        BLOCK,        // the sender waits for space
+        REJECT,       // the send fails with Actor::REJECTED
+        DROP_OLDEST   // the oldest waiting job is destroyed unrun to make room
+    };
+
+    enum Expiry
+    {
+        DROP_EXPIRED,  // a job whose deadline has passed is destroyed unrun
+        RUN_LATE       // it runs anyway, with Actor::late() true
+    };
+
+    uint32_t capacity = 0;      // jobs per lane, rounded up to a power of two, 0 is unbounded
+    Overflow overflow = BLOCK;
+    uint32_t coalesceKeys = 0;  // keys 0 .. coalesceKeys - 1 for execJobCoalesced
+    uint32_t weights[LANES] = { 0, 16, 4, 1 };  // jobs per turn of each user lane
+    Expiry expiry = DROP_EXPIRED;
+    int node = -1;              // home NUMA node: holds the mailbox memory and takes its wakeups, -1 for none
+    bool cancelOnClose = false; // ~Actor destroys the user jobs still queued instead of running them
+};
+
+// A mailbox scheduled onto a Scheduler's workers, it runs at most one job at
+// a time and gives its worker up after d_quota jobs so busy actors cannot
+// starve the others. d_pending counts jobs sent but not yet run: the sender
+// that raises it from zero schedules the actor, and the worker keeps it
+// until its own decrement brings the count back to zero. Senders count a
+// job only once it is in the mailbox, and a slice never runs more jobs than
+// it saw counted, so the count cannot drop below the jobs still waiting.
+// Every job travels in a lane. Internal jobs such as shutdown and coroutine
+// resumption use SYSTEM_LANE, which is unbounded and drains before anything
+// else; the user lanes share the worker by weighted round robin and stay
+// FIFO within a lane. A bounded actor keeps each user lane in its own
+// preallocated ring. A job past its deadline is dropped or flagged late
+struct Actor : MpscNode
+{
+    typedef InlineJob<96> Job;
+
+    enum { DEFAULT_QUOTA = 64 };
+
+    enum SendResult { SENT, REJECTED, DROPPED_OLDEST, COALESCED };
+
+    typedef ActorMetrics<ACTOR_METRICS> Metrics;
+    typedef Metrics::Stamp Stamp;
+
+    struct Mail : MpscNode
+    {
+        atomic<uint32_t> d_nextFree;
+        uint32_t d_index;
+        Job d_job;
+        Deadline d_deadline;
+        [[no_unique_address]] Stamp d_sent;
+    };
+
+    // A job waiting in a bounded ring
+    struct Letter
+    {
+        Job d_job;
+        Deadline d_deadline;
+        [[no_unique_address]] Stamp d_sent;
+    };
+
+    Scheduler& d_scheduler;
+    const int d_quota;
+    const MailboxOptions d_options;
+    NodePool<Mail> d_mailPool;
+    MpscQueue d_jobQueues[LANES];
+    std::unique_ptr<BoundedRing<Letter> > d_rings[LANES];  // user lanes of a bounded actor
+    std::unique_ptr<atomic<Mail*>[]> d_coalesced;
+    atomic<uint32_t> d_pending;
+    atomic<uint32_t> d_spaceEpoch;  // bumped whenever blocked senders may retry
+    atomic<uint32_t> d_blockedSenders;
+    atomic<uint32_t> d_droppedCounts;  // counts of dropped jobs no job carries on
+    atomic<uint64_t> d_expired;
+    SyncSlot* d_closed;  // set by the last job, only ever touched by workers
+    int d_lane;          // user lane whose turn it is, and the jobs it has left,
+    uint32_t d_credit;   // both only ever touched by workers
+    [[no_unique_address]] Metrics d_metrics;
+
+    static thread_local Actor* s_current;
+    static thread_local bool s_late;
+
+    explicit Actor(Scheduler& scheduler = Scheduler::instance(), int quota = DEFAULT_QUOTA,
+        const MailboxOptions& options = MailboxOptions())
+        : d_scheduler(scheduler), d_quota(quota), d_options(options), d_mailPool(options.node),
+          d_coalesced(new atomic<Mail*>[options.coalesceKeys]),
+          d_pending(0), d_spaceEpoch(0), d_blockedSenders(0), d_droppedCounts(0), d_expired(0), d_closed(nullptr),
+          d_lane(LOW_LANE), d_credit(0)
+    {
+        for (int lane = HIGH_LANE; lane != LANES && options.capacity; ++lane)
+            d_rings[lane].reset(new BoundedRing<Letter>(options.capacity, options.node));
+        for (uint32_t k = 0; k != options.coalesceKeys; ++k) d_coalesced[k].store(nullptr, memory_order_relaxed);
+        d_metrics.attach(this);
+    }
+
+    // Waits for every job sent so far, the worker signals only once it is
+    // done with them all and finished with this actor. The closing job goes
+    // in SYSTEM_LANE, so under cancelOnClose it runs ahead of the backlog and
+    // every user job still queued behind it is destroyed unrun, failing any
+    // caller waiting on one with MailboxFull; shutdown then costs no more
+    // than destroying the backlog. Otherwise the backlog still runs first
+    ~Actor() // <------------ PATCH
+    {
+        SyncSlot closed;
+        post([this, &closed]() -> int
+        {
+            d_closed = &closed;
+            return 0;
+        });
+        closed.wait();
+        d_metrics.detach(this);
+    }
+
+    template <class F>
+    static void assignJob(Job& slot, F&& job) { slot.emplace(std::forward<F>(job)); }
+    static void assignJob(Job& slot, Job&& job) { slot = std::move(job); }
+
+    void addPending(uint32_t n)
+    {
+        const uint32_t before = d_pending.fetch_add(n, memory_order_acq_rel);
+        d_metrics.sent(before + n);
+        if (before == 0) d_scheduler.schedule(this);
+    }
+
+    // Straight into the lane's unbounded queue, built in a pooled node
+    template <class F>
+    void post(F&& job, Lane lane = SYSTEM_LANE, Deadline deadline = Deadline())
+    {
+        Mail* mail = d_mailPool.acquire();
+        assignJob(mail->d_job, std::forward<F>(job));
+        mail->d_deadline = deadline;
+        mail->d_sent = Metrics::sample();
+        d_jobQueues[lane].push(mail);
+        addPending(1);
+    }
+
+    template <class F>
+    SendResult execJobAsync(F&& job, Lane lane = NORMAL_LANE, Deadline deadline = Deadline())
+    {
+        assert(lane != SYSTEM_LANE && lane < LANES);
+        if (!d_rings[lane])
+        {
+            post(std::forward<F>(job), lane, deadline);
+            return SENT;
+        }
+        return sendBounded(*d_rings[lane], std::forward<F>(job), deadline);
+    }
+
+    // The first job a sender drops passes its count on to the job replacing
+    // it. A sender that has to drop more, because other producers keep taking
+    // the freed slots, leaves their counts in d_droppedCounts for the worker
+    // to settle, so only the worker ever brings d_pending down. Under
+    // DROP_OLDEST a sender never waits for space
+    template <class F>
+    SendResult sendBounded(BoundedRing<Letter>& ring, F&& job, Deadline deadline)
+    {
+        const auto fill = [&job, deadline](Letter& slot)
+        {
+            assignJob(slot.d_job, std::forward<F>(job));
+            slot.d_deadline = deadline;
+            slot.d_sent = Metrics::sample();
+        };
+        bool dropped = false;
+        for (;;)
+        {
+            if (ring.tryPush(fill)) break;
+            if (d_options.overflow == MailboxOptions::REJECT) return REJECTED;
+            if (d_options.overflow == MailboxOptions::DROP_OLDEST)
+            {
+                Job oldest;
+                if (!ring.tryPop([&oldest](Letter& l) { oldest = std::move(l.d_job); })) continue;
+                if (dropped) d_droppedCounts.fetch_add(1, memory_order_release);
+                dropped = true;
+                continue;
+            }
+            waitForSpace(ring);
+        }
+        if (dropped) return DROPPED_OLDEST;
+        addPending(1);
+        return SENT;
+    }
+
+    void waitForSpace(const BoundedRing<Letter>& ring)
+    {
+        const Stamp t0 = Metrics::now();
+        d_blockedSenders.fetch_add(1, memory_order_seq_cst);
+        const uint32_t epoch = d_spaceEpoch.load(memory_order_seq_cst);
+        if (ring.size() == ring.capacity()) futexWait(d_spaceEpoch, epoch);
+        d_blockedSenders.fetch_sub(1, memory_order_relaxed);
+        d_metrics.blocked(t0, Metrics::now());
+    }
+
+    void wakeBlockedSenders()
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (d_blockedSenders.load(memory_order_relaxed) == 0) return;
+        d_spaceEpoch.fetch_add(1, memory_order_seq_cst);
+        futexWake(d_spaceEpoch, INT_MAX);
+    }
+
+    // Jobs the lane's bounded ring could still take, unbounded actors never run out
+    size_t remainingCapacity(Lane lane = NORMAL_LANE) const
+    {
+        return d_rings[lane] ? d_rings[lane]->capacity() - d_rings[lane]->size() : SIZE_MAX;
+    }
+
+    // Jobs dropped or run late because their deadline had passed
+    uint64_t expiredJobs() const { return d_expired.load(memory_order_relaxed); }
+
+    // True inside a job that started after its deadline, under RUN_LATE
+    static bool late() { return s_late; }
+
+    // Publishes [first, last) with one exchange and at most one wakeup, the
+    // callables are moved out of the range. A bounded actor takes them one
+    // at a time under its overflow policy. Returns the number accepted
+    template <class Iter>
+    size_t execJobAsyncBatch(Iter first, Iter last, Lane lane = NORMAL_LANE)
+    {
+        assert(lane != SYSTEM_LANE && lane < LANES);
+        const uint32_t n = std::distance(first, last);
+        if (n == 0) return 0;
+        if (d_rings[lane])
+        {
+            size_t accepted = 0;
+            for (; first != last; ++first) accepted += execJobAsync(std::move(*first), lane) != REJECTED;
+            return accepted;
+        }
+
+        Mail* head = nullptr;
+        Mail* tail = nullptr;
+        d_mailPool.acquire(n, [&](Mail* mail)
+        {
+            assignJob(mail->d_job, std::move(*first++));
+            mail->d_deadline = Deadline();
+            mail->d_sent = Metrics::sample();
+            if (tail) tail->d_next.store(mail, memory_order_relaxed);
+            else head = mail;
+            tail = mail;
+        });
+        d_jobQueues[lane].push(head, tail);
+        addPending(n);
+        return n;
+    }
+
+    // At most one job per key waits in the mailbox: a newer job for the same
+    // key replaces it, so a stream of updates costs one slot. Under REJECT or
+    // DROP_OLDEST the waiting job of a key can be lost with its placeholder
+    template <class F>
+    SendResult execJobCoalesced(uint32_t key, F&& job)
+    {
+        assert(key < d_options.coalesceKeys);
+        Mail* mail = d_mailPool.acquire();
+        assignJob(mail->d_job, std::forward<F>(job));
+        if (Mail* replaced = d_coalesced[key].exchange(mail, memory_order_acq_rel))
+        {
+            discardMail(replaced);
+            return COALESCED;
+        }
+
+        // The placeholder takes the waiting job with it if it is rejected or dropped
+        const auto dropped = [this, key] { discardCoalesced(key); };
+        return execJobAsync([this, key, notice = DropNotice(dropped)]() mutable -> int
+        {
+            notice.disarm();
+            return runCoalesced(key);
+        });
+    }
+
+    int runCoalesced(uint32_t key)
+    {
+        Mail* mail = d_coalesced[key].exchange(nullptr, memory_order_acq_rel);
+        if (!mail) return 0;
+        const int rc = mail->d_job();
+        discardMail(mail);
+        return rc;
+    }
+
+    void discardCoalesced(uint32_t key)
+    {
+        if (Mail* mail = d_coalesced[key].exchange(nullptr, memory_order_acq_rel)) discardMail(mail);
+    }
+
+    void discardMail(Mail* mail)
+    {
+        mail->d_job.reset();
+        d_mailPool.release(mail);
+    }
+
+    // Called from one of its own jobs the actor runs the job inline, anything
+    // else would wait on itself. Exceptions thrown by the job reach the caller,
+    // and a job rejected or dropped by a full mailbox throws MailboxFull.
+    // Called from another actor's job it blocks that worker, so a chain of
+    // such calls must not be able to occupy every worker of the scheduler
+    template <class F>
+    int execJobSync(F&& job, Lane lane = NORMAL_LANE)
+    {
+        if (s_current == this) return job();
+
+        SyncSlot slot;
+        const auto dropped = [&slot] { slot.fail(std::make_exception_ptr(MailboxFull())); };
+        execJobAsync([&job, &slot, notice = DropNotice(dropped)]() mutable -> int
+        {
+            notice.disarm();
+            slot.run(job);
+            return 0;
+        }, lane);
+        return slot.wait();
+    }
+
+    // Awaitable call: the job is queued at once, so several calls can be in
+    // flight before the first co_await. The awaiting coroutine resumes on the
+    // actor it awaited from, or, awaiting from no actor, on the worker that
+    // ran the job
+    template <class F>
+    Call<typename std::invoke_result<F&>::type> call(F&& job, Lane lane = NORMAL_LANE)
+    {
+        return Call<typename std::invoke_result<F&>::type>(*this, std::forward<F>(job), lane);
+    }
+
+    // Runs a coroutine on this actor; whenever it awaits a call it resumes
+    // here, so it never blocks the worker and never runs beside other jobs
+    void spawn(Task task);
+
+    // Runs up to d_quota of the jobs counted so far, SYSTEM_LANE first and
+    // then the user lanes by weight, and hands the finished nodes back to the
+    // pool with one CAS. True if jobs are still pending and the actor must be
+    // queued again; once false the worker is done with it
+    bool runSlice()
+    {
+        s_current = this;
+        const uint32_t budget = std::min<uint32_t>(d_quota, d_pending.load(memory_order_acquire));
+        Mail* done = nullptr;
+        Mail* doneLast = nullptr;
+        uint32_t ran = 0, fromRing = 0;
+        for (; ran != budget; ++ran)
+        {
+            Mail* mail = static_cast<Mail*>(d_jobQueues[SYSTEM_LANE].pop());
+            const bool internal = mail != nullptr;
+            if (!mail && !takeUserJob(mail, fromRing)) break;
+            if (!mail) continue;
+
+            if (internal || !cancelled()) runJob(mail->d_job, mail->d_deadline, mail->d_sent);
+            mail->d_job.reset();
+            if (done) NodePool<Mail>::link(mail, done);
+            else doneLast = mail;
+            done = mail;
+        }
+        if (done) d_mailPool.release(done, doneLast);
+        if (fromRing) wakeBlockedSenders();
+        s_current = nullptr;
+
+        SyncSlot* const closed = d_closed;
+        const uint32_t settled = ran + d_droppedCounts.exchange(0, memory_order_acquire);
+        if (d_pending.fetch_sub(settled, memory_order_acq_rel) != settled) return true;
+        if (closed) closed->complete();
+        return false;
+    }
+
+    // Weighted round robin over the user lanes: a lane keeps the worker for
+    // its weight in jobs or until it runs dry, then the next lane has its
+    // turn. A job from a ring is run here, one from a queue is handed back
+    // in mail. False when every user lane is empty
+    bool takeUserJob(Mail*& mail, uint32_t& fromRing)
+    {
+        for (int tried = HIGH_LANE; tried != LANES; ++tried)
+        {
+            if (d_credit == 0)
+            {
+                d_lane = d_lane == LOW_LANE ? HIGH_LANE : d_lane + 1;
+                d_credit = std::max<uint32_t>(1, d_options.weights[d_lane]);
+            }
+            if (!d_rings[d_lane])
+            {
+                if ((mail = static_cast<Mail*>(d_jobQueues[d_lane].pop()))) { --d_credit; return true; }
+            }
+            else
+            {
+                Letter letter;
+                const auto take = [&letter](Letter& l)
+                {
+                    letter.d_job = std::move(l.d_job);
+                    letter.d_deadline = l.d_deadline;
+                    letter.d_sent = l.d_sent;
+                };
+                if (d_rings[d_lane]->tryPop(take))
+                {
+                    --d_credit;
+                    ++fromRing;
+                    if (!cancelled()) runJob(letter.d_job, letter.d_deadline, letter.d_sent);
+                    return true;
+                }
+            }
+            d_credit = 0;
+        }
+        return false;
+    }
+
+    // User jobs are destroyed unrun once the closing job has run
+    bool cancelled() const { return d_closed && d_options.cancelOnClose; }
+
+    // A job found past its deadline counts as expired, and under
+    // DROP_EXPIRED is left for its owner to destroy unrun. Only jobs that
+    // carry a deadline read the clock
+    void runJob(Job& job, Deadline deadline, Stamp sent)
+    {
+        if (deadline != Deadline() && chrono::steady_clock::now() > deadline)
+        {
+            d_expired.fetch_add(1, memory_order_relaxed);
+            if (d_options.expiry == MailboxOptions::DROP_EXPIRED) return;
+            s_late = true;
+        }
+        // Cleared however job() leaves, so a throwing job cannot make the
+        // next one on this worker look late
+        struct ClearLate { ~ClearLate() { s_late = false; } } clearLate;
+        const Stamp start = d_metrics.start(sent);
+        job();
+        d_metrics.finish(start);
+    }
+};
+
+thread_local Actor* Actor::s_current = nullptr;
+thread_local bool Actor::s_late = false;
+thread_local Scheduler::Worker* Scheduler::s_worker = nullptr;
+
+void Scheduler::schedule(Actor* actor)
+{
+    if (s_worker && s_worker->d_owner == this)
+    {
+        s_worker->d_ready.push(actor);
+        wakeOne();
+        return;
+    }
+    Worker& w = inboxFor(actor->d_options.node);
+    w.d_inbox.push(actor);
+    w.d_wake.notify();
+}
+
+// Next worker round-robin, preferring those pinned to the given node
+Scheduler::Worker& Scheduler::inboxFor(int node)
+{
+    const size_t start = d_nextInbox.fetch_add(1, memory_order_relaxed);
+    for (size_t i = 0; node >= 0 && i != d_workers.size(); ++i)
+    {
+        Worker& w = *d_workers[(start + i) % d_workers.size()];
+        if (w.d_node == node) return w;
+    }
+    return *d_workers[start % d_workers.size()];
+}
+
+// Own inbox first, then own deque, then the other workers' deques
+Actor* Scheduler::take(Worker& self, size_t selfIndex)
+{
+    bool moved = false;
+    while (MpscNode* node = self.d_inbox.pop())
+    {
+        self.d_ready.push(static_cast<Actor*>(node));
+        moved = true;
+    }
+    if (moved && d_workers.size() > 1) wakeOne();
+
+    if (Actor* actor = self.d_ready.steal()) return actor;
+    for (size_t i = 1; i != d_workers.size(); ++i)
+        if (Actor* actor = d_workers[(selfIndex + i) % d_workers.size()]->d_ready.steal()) return actor;
+    return nullptr;
+}
+
+// Polls for up to the worker's spin window, sleeping between polls in
+// umwait on its own inbox where the cpu has it and on pause otherwise. The
+// window adapts: spinning that finds work doubles it, up to spinNanos, and
+// spinning in vain halves it, down to a sixteenth, so a worker whose actors
+// stay quiet soon goes back to parking cheaply
+Actor* Scheduler::spin(Worker& self, size_t selfIndex)
+{
+    if (self.d_spin == 0) return nullptr;
+    const chrono::steady_clock::time_point until =
+        chrono::steady_clock::now() + chrono::nanoseconds(self.d_spin);
+    const bool waitpkg = hasWaitpkg();
+    do
+    {
+        if (waitpkg) monitorWord(self.d_inbox.pushWord());
+        if (Actor* actor = take(self, selfIndex))
+        {
+            self.d_spin = std::min(d_options.spinNanos, self.d_spin * 2);
+            return actor;
+        }
+        if (waitpkg) waitOnMonitor(__rdtsc() + SPIN_SLICE_TICKS);
+        else for (int i = 0; i != 16; ++i) __builtin_ia32_pause();
+    } while (d_running.load(memory_order_relaxed) && chrono::steady_clock::now() < until);
+    self.d_spin = std::max(d_options.spinNanos / 16, self.d_spin / 2);
+    return nullptr;
+}
+
+// Spins, then parks after announcing itself and finding nothing to run,
+// null on shutdown
+Actor* Scheduler::findWork(Worker& self, size_t selfIndex)
+{
+    while (d_running.load(memory_order_relaxed))
+    {
+        if (Actor* actor = take(self, selfIndex)) return actor;
+        if (Actor* actor = spin(self, selfIndex)) return actor;
+
+        self.d_wake.prepareWait();
+        d_sleepers.fetch_add(1, memory_order_seq_cst);
+        Actor* actor = take(self, selfIndex);
+        if (actor || !d_running.load()) self.d_wake.cancelWait();
+        else self.d_wake.commitWait();
+        d_sleepers.fetch_sub(1, memory_order_relaxed);
+        if (actor) return actor;
+    }
+    return nullptr;
+}
+
+void Scheduler::run(size_t index)
+{
+    Worker& self = *d_workers[index];
+    s_worker = &self;
+    if (!d_options.cpus.empty()) pinThread(std::vector<int>(1, d_options.cpus[index % d_options.cpus.size()]));
+    else if (self.d_node >= 0) pinThread(cpusOfNode(self.d_node));
+    while (Actor* actor = findWork(self, index))
+        if (actor->runSlice()) schedule(actor);
+}
+
+// One live actor as seen by snapshotActors, times in nanoseconds
+struct ActorSnapshot
+{
+    const Actor* actor;
+    uint32_t depth;      // jobs sent but not yet run
+    uint32_t peakDepth;
+    uint64_t jobs;       // run since the actor was built
+    double jobsPerSecond;  // since the previous snapshot
+    double queuedP50, queuedP99;
+    double runP50, runP99;
+    uint64_t blockedSends;  // sends that waited on a full bounded mailbox
+    double blockedNanos;
+};
+
+// Every live actor's metrics, empty unless built with ACTOR_METRICS.
+// Latencies come from the sampled jobs only
+std::vector<ActorSnapshot> snapshotActors()
+{
+    std::vector<ActorSnapshot> snapshots;
+#if ACTOR_METRICS
+    typedef ActorMetrics<true> Metrics;
+    const double nanos = Metrics::nanosPerTick();
+    const Metrics::Stamp now = Metrics::now();
+
+    lock_guard<mutex> g(Metrics::registryMutex());
+    for (Actor* actor : Metrics::registry())
+    {
+        Metrics& m = actor->d_metrics;
+        ActorSnapshot s;
+        s.actor = actor;
+        s.depth = actor->d_pending.load(memory_order_relaxed);
+        s.peakDepth = m.d_peakDepth.load(memory_order_relaxed);
+        s.jobs = m.d_jobs.load(memory_order_relaxed);
+        s.jobsPerSecond = (s.jobs - m.d_lastJobs) / ((now - m.d_lastStamp) * nanos) * 1e9;
+        s.queuedP50 = m.d_queued.percentile(0.50) * nanos;
+        s.queuedP99 = m.d_queued.percentile(0.99) * nanos;
+        s.runP50 = m.d_run.percentile(0.50) * nanos;
+        s.runP99 = m.d_run.percentile(0.99) * nanos;
+        s.blockedSends = m.d_blockedSends.load(memory_order_relaxed);
+        s.blockedNanos = m.d_blockedTicks.load(memory_order_relaxed) * nanos;
+        m.d_lastJobs = s.jobs;
+        m.d_lastStamp = now;
+        snapshots.push_back(s);
+    }
+#endif
+    return snapshots;
+}
+
+void printActorSnapshots(std::ostream& out, const std::vector<ActorSnapshot>& snapshots)
+{
+    out << "actor,depth,peak,jobs,jobs/s,queued p50 ns,queued p99 ns,run p50 ns,run p99 ns,blocked sends,blocked ns" << std::endl;
+    for (const ActorSnapshot& s : snapshots)
+        out << s.actor << ',' << s.depth << ',' << s.peakDepth << ',' << s.jobs << ',' << s.jobsPerSecond << ','
+            << s.queuedP50 << ',' << s.queuedP99 << ',' << s.runP50 << ',' << s.runP99 << ','
+            << s.blockedSends << ',' << s.blockedNanos << std::endl;
+}
+
+// Value a call produced, nothing to keep for void jobs
+template <class T>
+struct CallResult
+{
+    std::optional<T> d_value;
+
+    template <class F>
+    void store(F& job) { d_value.emplace(job()); }
+    T take() { return std::move(*d_value); }
+};
+
+template <>
+struct CallResult<void>
+{
+    template <class F>
+    void store(F& job) { job(); }
+    void take() {}
+};
+
+// Result slot of one Actor::call, living in the awaiting coroutine's frame.
+// The caller is resumed on the actor it was running on when it suspended;
+// a caller running on no actor resumes on the worker that ran the job
+template <class T>
+class Call
+{
+    enum { PENDING, WAITING, DONE };
+
+    atomic<uint32_t> d_state;
+    CallResult<T> d_result;
+    std::exception_ptr d_error;
+    std::coroutine_handle<> d_waiter;
+    Actor* d_executor;
+
+    template <class F>
+    void run(F& job)
+    {
+        try { d_result.store(job); }
+        catch (...) { d_error = std::current_exception(); }
+        finish();
+    }
+
+    void fail(std::exception_ptr error)
+    {
+        d_error = error;
+        finish();
+    }
+
+    void finish()
+    {
+        if (d_state.exchange(DONE, memory_order_acq_rel) != WAITING) return;
+        const std::coroutine_handle<> waiter = d_waiter;
+        if (Actor* executor = d_executor)
+            executor->post([waiter]() -> int { waiter.resume(); return 0; });
+        else
+        {
+            Actor* const current = Actor::s_current;
+            Actor::s_current = nullptr;
+            waiter.resume();
+            Actor::s_current = current;
+        }
+    }
+
+public:
+    template <class F>
+    Call(Actor& actor, F&& job, Lane lane = NORMAL_LANE) : d_state(PENDING), d_executor(nullptr)
+    {
+        if (Actor::s_current == &actor)
+        {
+            run(job);
+            return;
+        }
+        // A rejected job is destroyed unrun, so its notice fails the call
+        const auto dropped = [this] { fail(std::make_exception_ptr(MailboxFull())); };
+        actor.execJobAsync([this, job = std::forward<F>(job), notice = DropNotice(dropped)]() mutable -> int
+        {
+            notice.disarm();
+            run(job);
+            return 0;
+        }, lane);
+    }
+
+    Call(const Call&) = delete;
+    Call& operator=(const Call&) = delete;
+
+    // A call that was never awaited still owns the slot its job writes to
+    ~Call()
+    {
+        while (d_state.load(memory_order_acquire) != DONE) this_thread::yield();
+    }
+
+    struct Awaiter
+    {
+        Call* d_call;
+
+        bool await_ready() const { return d_call->d_state.load(memory_order_acquire) == DONE; }
+
+        bool await_suspend(std::coroutine_handle<> waiter)
+        {
+            d_call->d_waiter = waiter;
+            d_call->d_executor = Actor::s_current;
+            uint32_t expected = PENDING;
+            return d_call->d_state.compare_exchange_strong(expected, WAITING, memory_order_acq_rel);
+        }
+
+        T await_resume()
+        {
+            if (d_call->d_error) std::rethrow_exception(d_call->d_error);
+            return d_call->d_result.take();
+        }
+    };
+
+    // The slot is awaited in place, it cannot move once its job is queued
+    Awaiter operator co_await() { return Awaiter{ this }; }
+};
+
+// Fire-and-forget coroutine, it starts suspended and runs once handed to
+// Actor::spawn. An exception escaping it terminates the process
+class Task
+{
+public:
+    struct promise_type
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Task(Task&& other) : d_handle(std::exchange(other.d_handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        if (d_handle) d_handle.destroy();
+    }
+
+    std::coroutine_handle<> release() { return std::exchange(d_handle, nullptr); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : d_handle(handle) {}
+
+    std::coroutine_handle<promise_type> d_handle;
+};
+
+void Actor::spawn(Task task)
+{
+    const std::coroutine_handle<> handle = task.release();
+    post([handle]() -> int { handle.resume(); return 0; });
+}
+
+// The previous mailbox, kept as the baseline for the benchmarks
+struct LockedActor
 {
     typedef function<int()> Job;
 
     std::queue<Job> d_jobQueue;
-
     mutex d_jobQueueMutex;
     condition_variable d_hasJob;
-
     bool d_keepWorkerRunning;
     thread d_worker;
 
-    Actor()
-        : d_keepWorkerRunning(true), d_worker(&Actor::workerThread, this)
-    {}
+    LockedActor() : d_keepWorkerRunning(true), d_worker(&LockedActor::workerThread, this) {}
 
-    ~Actor() // <------------ PATCH
+    ~LockedActor()
     {
-        execJobSync([this]()->int
-        {
-            d_keepWorkerRunning = false;
-            return 0;
-        });
+        execJobAsync([this]()->int { d_keepWorkerRunning = false; return 0; });
         d_worker.join();
     }
 
     void execJobAsync(const Job& job)
     {
-        mutex::scoped_lock g(d_jobQueueMutex);
+        lock_guard<mutex> g(d_jobQueueMutex);
         d_jobQueue.push(job);
         d_hasJob.notify_one();
     }
 
     int execJobSync(const Job& job)
     {
-        std::string error;
         promise<int> promise;
         unique_future<int> future = promise.get_future();
+        execJobAsync([&]() -> int
         {
-            mutex::scoped_lock g(d_jobQueueMutex);
-            d_jobQueue.push([&]() -> int
-            {
-                    int rc = job();    
-                    promise.set_value(rc);
-                    return 0;
-            });
-            d_hasJob.notify_one();
-        }
+                int rc = job();
+                promise.set_value(rc);
+                return 0;
+        });
         int rc = future.get();
         return rc;
     }
@@ -68,22 +1746,633 @@ struct Actor
     {
         while (d_keepWorkerRunning)
         {
-            unique_lock<mutex> g(d_jobQueueMutex);
+            Job job;
+            {
+                unique_lock<mutex> g(d_jobQueueMutex);
+                while (d_jobQueue.empty()) d_hasJob.wait(g);
+                job = d_jobQueue.front();
+                d_jobQueue.pop();
+            }
+            job();
+        }
+    }
+};
 
-            while (d_jobQueue.empty()) { d_hasJob.wait(g); }
+// One execJobAsync per job
+struct EnqueueSingly
+{
+    template <class A>
+    void operator()(A& actor, long& executed, int jobs) const
+    {
+        for (int i = 0; i != jobs; ++i)
+            actor.execJobAsync([&executed]() -> int { ++executed; return 0; });
+    }
+};
 
-            Job job = d_jobQueue.front();
-            assert(!d_jobQueue.empty());
-            d_jobQueue.pop();
-            
-            g.release(); // <------------ PATCH
-            d_jobQueueMutex.unlock();
+// Bursts of d_burst jobs, each published with one execJobAsyncBatch
+struct EnqueueBatched
+{
+    int d_burst;
 
-            job();
-        }
+    void operator()(Actor& actor, long& executed, int jobs) const
+    {
+        auto job = [&executed]() -> int { ++executed; return 0; };
+        std::vector<decltype(job)> burst(d_burst, job);
+        for (int i = 0; i < jobs; i += d_burst) actor.execJobAsyncBatch(burst.begin(), burst.end());
+    }
+};
+
+// Jobs per second from enqueue of the first job to execution of the last
+template <class A, class Enqueue>
+double enqueueRate(int producers, int perProducer, Enqueue enqueue)
+{
+    long executed = 0;
+    chrono::steady_clock::time_point start;
+    {
+        A actor;
+        start = chrono::steady_clock::now();
+
+        std::vector<thread*> threads;
+        for (int p = 0; p != producers; ++p)
+            threads.push_back(new thread([&]() { enqueue(actor, executed, perProducer); }));
+        for (size_t p = 0; p != threads.size(); ++p) { threads[p]->join(); delete threads[p]; }
+    }
+    const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    assert(executed == long(perProducer) * producers);
+    return executed / elapsed.count();
+}
+
+// Enqueue throughput with 1 to 64 producers hammering one actor
+void benchmarkEnqueue()
+{
+    const int totalJobs = 1 << 20, burst = 64;
+    std::cout << "producers,lock-free Mjobs/s,batch" << burst << " Mjobs/s,mutex Mjobs/s" << std::endl;
+
+    for (int producers = 1; producers <= 64; producers *= 2)
+    {
+        const int perProducer = totalJobs / producers;
+        const EnqueueBatched batched = { burst };
+        std::cout << producers
+                  << "," << enqueueRate<Actor>(producers, perProducer, EnqueueSingly()) / 1e6
+                  << "," << enqueueRate<Actor>(producers, perProducer, batched) / 1e6
+                  << "," << enqueueRate<LockedActor>(producers, perProducer, EnqueueSingly()) / 1e6 << std::endl;
+    }
+}
+
+// Mean round trip of an empty synchronous call
+template <class A>
+double syncCallNanos(int calls)
+{
+    A actor;
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int sum = 0;
+    for (int i = 0; i != calls; ++i) sum += actor.execJobSync([i]() -> int { return i & 1; });
+    const chrono::duration<double, boost::nano> elapsed = chrono::steady_clock::now() - start;
+
+    assert(sum == calls / 2);
+    (void)sum;
+    return elapsed.count() / calls;
+}
+
+void benchmarkSyncCall()
+{
+    const int calls = 1 << 16;
+    std::cout << "sync call ns,slot " << syncCallNanos<Actor>(calls)
+              << ",promise " << syncCallNanos<LockedActor>(calls) << std::endl;
+}
+
+// Mean delay from send to start of a job sent to an idle actor, so every
+// job finds the worker either parked or inside its spin window
+double wakeupNanos(Scheduler& pool, int sends)
+{
+    Actor actor(pool);
+    double total = 0;
+    for (int i = 0; i != sends; ++i)
+    {
+        this_thread::sleep_for(chrono::microseconds(50));
+        const chrono::steady_clock::time_point sent = chrono::steady_clock::now();
+        actor.execJobSync([&total, sent]() -> int
+        {
+            total += chrono::duration<double, boost::nano>(chrono::steady_clock::now() - sent).count();
+            return 0;
+        });
+    }
+    return total / sends;
+}
+
+void benchmarkWakeup()
+{
+    const int sends = 2000;
+    Scheduler parking(1);
+    SchedulerOptions options;
+    options.threads = 1;
+    options.spinNanos = 200000;
+    Scheduler spinning(options);
+    std::cout << "wakeup ns,parked " << wakeupNanos(parking, sends)
+              << ",spinning " << wakeupNanos(spinning, sends) << std::endl;
+}
+
+// 20k actors sharing the default scheduler's threads, where a thread per
+// actor would have meant 20k OS threads
+void benchmarkManyActors()
+{
+    const int actors = 20000, jobs = 16;
+    atomic<long> executed(0);
+
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    {
+        std::vector<Actor*> all;
+        for (int a = 0; a != actors; ++a) all.push_back(new Actor);
+        for (int j = 0; j != jobs; ++j)
+            for (int a = 0; a != actors; ++a)
+                all[a]->execJobAsync([&executed]() -> int { executed.fetch_add(1, memory_order_relaxed); return 0; });
+        for (int a = 0; a != actors; ++a) delete all[a];
+    }
+    const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    assert(executed.load() == long(actors) * jobs);
+    std::cout << actors << " actors on " << Scheduler::instance().threads() << " threads,"
+              << executed.load() / elapsed.count() / 1e6 << " Mjobs/s" << std::endl;
+}
+
+// Results, exceptions and calls made from inside the actor
+void checkSyncCall()
+{
+    Actor actor;
+    assert(actor.execJobSync([]() -> int { return 42; }) == 42);
+
+    bool caught = false;
+    try { actor.execJobSync([]() -> int { throw std::runtime_error("job failed"); }); }
+    catch (const std::runtime_error& e) { caught = std::string(e.what()) == "job failed"; }
+    assert(caught);
+
+    const int nested = actor.execJobSync([&actor]() -> int
+    {
+        return actor.execJobSync([]() -> int { return 7; }) + 1;
+    });
+    assert(nested == 8);
+    (void)nested;
+    (void)caught;
+}
+
+// A batch runs in order, with single jobs either side of it
+void checkBatch()
+{
+    Actor actor;
+    std::vector<int> order;
+    std::vector<function<int()> > batch;
+    for (int i = 1; i != 1001; ++i) batch.push_back([&order, i]() -> int { order.push_back(i); return 0; });
+
+    actor.execJobAsync([&order]() -> int { order.push_back(0); return 0; });
+    actor.execJobAsyncBatch(batch.begin(), batch.end());
+    actor.execJobSync([&order]() -> int { order.push_back(1001); return 0; });
+
+    assert(order.size() == 1002);
+    for (int i = 0; i != 1002; ++i) assert(order[i] == i);
+
+    // Jobs already wrapped in Actor::Job are moved in, not wrapped again
+    std::vector<Actor::Job> jobs;
+    for (int i = 1002; i != 1010; ++i) jobs.emplace_back([&order, i]() -> int { order.push_back(i); return 0; });
+    assert(actor.execJobAsyncBatch(jobs.begin(), jobs.end()) == jobs.size());
+    actor.execJobSync([]() -> int { return 0; });
+    assert(order.size() == 1010 && order.back() == 1009);
+}
+
+// Each actor runs one job at a time however many workers and producers
+// there are, so unsynchronised counters inside its jobs lose nothing
+void checkScheduler()
+{
+    const int actors = 500, producers = 4, jobs = 100;
+    Scheduler pool(4);
+    std::vector<Actor*> all;
+    std::vector<int> counts(actors, 0);
+    for (int a = 0; a != actors; ++a) all.push_back(new Actor(pool));
+
+    std::vector<thread*> threads;
+    for (int p = 0; p != producers; ++p)
+        threads.push_back(new thread([&]()
+        {
+            for (int j = 0; j != jobs; ++j)
+                for (int a = 0; a != actors; ++a)
+                    all[a]->execJobAsync([&counts, a]() -> int { ++counts[a]; return 0; });
+        }));
+    for (size_t p = 0; p != threads.size(); ++p) { threads[p]->join(); delete threads[p]; }
+
+    for (int a = 0; a != actors; ++a)
+    {
+        assert(all[a]->execJobSync([&counts, a]() -> int { return counts[a]; }) == producers * jobs);
+        delete all[a];
+    }
+}
+
+// A busy actor yields its worker after its quota, so an actor that became
+// ready behind it runs long before the busy one's backlog is done
+void checkFairness()
+{
+    const int quota = 16;
+    Scheduler pool(1);
+    Actor gate(pool), busy(pool, quota), quiet(pool, quota);
+    atomic<bool> hold(true);
+    atomic<int> busyRan(0);
+    int seenByQuiet = -1;
+
+    gate.execJobAsync([&hold]() -> int { while (hold.load()) this_thread::yield(); return 0; });
+    for (int i = 0; i != 1000; ++i) busy.execJobAsync([&busyRan]() -> int { ++busyRan; return 0; });
+    quiet.execJobAsync([&]() -> int { seenByQuiet = busyRan.load(); return 0; });
+    hold.store(false);
+
+    quiet.execJobSync([]() -> int { return 0; });
+    busy.execJobSync([]() -> int { return 0; });
+    assert(seenByQuiet == quota);
+    assert(busyRan.load() == 1000);
+}
+
+// A held-back actor with 1000 jobs queued behind the hold, as a snapshot sees it
+void checkMetrics()
+{
+    Scheduler pool(1);
+    Actor actor(pool);
+    atomic<bool> hold(true);
+
+    actor.execJobAsync([&hold]() -> int { while (hold.load()) this_thread::yield(); return 0; });
+    for (int i = 0; i != 1000; ++i) actor.execJobAsync([]() -> int { return 0; });
+    hold.store(false);
+    actor.execJobSync([]() -> int { return 0; });
+
+    const std::vector<ActorSnapshot> snapshots = snapshotActors();
+#if ACTOR_METRICS
+    assert(snapshots.size() == 1 && snapshots[0].actor == &actor);
+    assert(snapshots[0].peakDepth >= 1001);
+    assert(snapshots[0].jobs >= 1001);  // the sync job counts once its caller is already back
+    assert(snapshots[0].queuedP99 > 0 && snapshots[0].runP99 > 0);
+    printActorSnapshots(std::cout, snapshots);
+#else
+    assert(snapshots.empty());
+#endif
+}
+
+// Keeps the only worker of a one-thread scheduler busy until released, so
+// mailboxes fill up deterministically
+struct Gate
+{
+    Actor d_actor;
+    atomic<bool> d_hold;
+
+    explicit Gate(Scheduler& pool) : d_actor(pool), d_hold(true)
+    {
+        d_actor.execJobAsync([this]() -> int { while (d_hold.load()) this_thread::yield(); return 0; });
     }
+
+    void release() { d_hold.store(false); }
 };
 
+// Each overflow policy, capacity queries and coalescing
+void checkBoundedMailbox()
+{
+    Scheduler pool(1);
+    std::vector<int> ran;
+    const auto record = [&ran](int i) { return [&ran, i]() -> int { ran.push_back(i); return 0; }; };
+
+    {
+        Gate gate(pool);
+        MailboxOptions options;
+        options.capacity = 8;
+        options.overflow = MailboxOptions::REJECT;
+        Actor actor(pool, Actor::DEFAULT_QUOTA, options);
+
+        for (int i = 0; i != 8; ++i) assert(actor.execJobAsync(record(i)) == Actor::SENT);
+        assert(actor.remainingCapacity() == 0);
+        assert(actor.execJobAsync(record(8)) == Actor::REJECTED);
+
+        bool full = false;
+        try { actor.execJobSync([]() -> int { return 0; }); }
+        catch (const MailboxFull&) { full = true; }
+        assert(full);
+        (void)full;
+
+        gate.release();
+        while (actor.remainingCapacity() != 8) this_thread::yield();
+        actor.execJobSync([]() -> int { return 0; });
+        assert(ran == std::vector<int>({ 0, 1, 2, 3, 4, 5, 6, 7 }));
+    }
+
+    {
+        ran.clear();
+        Gate gate(pool);
+        MailboxOptions options;
+        options.capacity = 4;
+        options.overflow = MailboxOptions::DROP_OLDEST;
+        Actor actor(pool, Actor::DEFAULT_QUOTA, options);
+
+        for (int i = 0; i != 3; ++i) actor.execJobAsync(record(i));
+        atomic<bool> dropped(false);
+        thread caller([&]()
+        {
+            try { actor.execJobSync([]() -> int { return 0; }); }
+            catch (const MailboxFull&) { dropped.store(true); }
+        });
+        while (actor.remainingCapacity() != 0) this_thread::yield();
+
+        for (int i = 3; i != 10; ++i) assert(actor.execJobAsync(record(i)) == Actor::DROPPED_OLDEST);
+        caller.join();
+        assert(dropped.load());
+
+        gate.release();
+        while (actor.remainingCapacity() != 4) this_thread::yield();
+        actor.execJobSync([]() -> int { return 0; });
+        assert(ran == std::vector<int>({ 6, 7, 8, 9 }));
+    }
+
+    {
+        ran.clear();
+        Gate gate(pool);
+        MailboxOptions options;
+        options.capacity = 2;
+        options.overflow = MailboxOptions::BLOCK;
+        Actor actor(pool, Actor::DEFAULT_QUOTA, options);
+
+        atomic<int> sent(0);
+        thread producer([&]()
+        {
+            for (int i = 0; i != 10; ++i)
+            {
+                actor.execJobAsync(record(i));
+                sent.fetch_add(1);
+            }
+        });
+        while (sent.load() != 2) this_thread::yield();
+        this_thread::sleep_for(chrono::milliseconds(10));
+        assert(sent.load() == 2);
+
+        gate.release();
+        producer.join();
+        actor.execJobSync([]() -> int { return 0; });
+        assert(ran == std::vector<int>({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 }));
+    }
+
+    {
+        ran.clear();
+        Gate gate(pool);
+        MailboxOptions options;
+        options.coalesceKeys = 2;
+        Actor actor(pool, Actor::DEFAULT_QUOTA, options);
+
+        assert(actor.execJobCoalesced(0, record(0)) == Actor::SENT);
+        assert(actor.execJobCoalesced(1, record(100)) == Actor::SENT);
+        for (int i = 1; i != 50; ++i) assert(actor.execJobCoalesced(0, record(i)) == Actor::COALESCED);
+
+        gate.release();
+        actor.execJobSync([]() -> int { return 0; });
+        assert(ran == std::vector<int>({ 49, 100 }));
+    }
+}
+
+// Producers racing for the slots of a full DROP_OLDEST mailbox keep
+// dropping rather than waiting while the worker is stalled, and the counts
+// of all those drops still settle so the actor can be destroyed
+void checkDropOldestNeverBlocks()
+{
+    const int producers = 4, jobs = 10000;
+    Scheduler pool(1);
+    Gate gate(pool);
+    MailboxOptions options;
+    options.capacity = 4;
+    options.overflow = MailboxOptions::DROP_OLDEST;
+    atomic<int> ran(0);
+    {
+        Actor actor(pool, Actor::DEFAULT_QUOTA, options);
+        std::vector<thread*> threads;
+        for (int p = 0; p != producers; ++p)
+            threads.push_back(new thread([&]()
+            {
+                for (int i = 0; i != jobs; ++i)
+                    actor.execJobAsync([&ran]() -> int { ran.fetch_add(1); return 0; });
+            }));
+        for (size_t p = 0; p != threads.size(); ++p) { threads[p]->join(); delete threads[p]; }
+        assert(actor.remainingCapacity() == 0);
+
+        gate.release();
+    }
+    assert(ran.load() == 4);
+}
+
+// Lanes drain by weight whatever order the jobs were sent in, an expired job
+// is dropped or flagged, and the same holds for a bounded actor's rings
+void checkPriorityLanes()
+{
+    Scheduler pool(1);
+    std::string ran;
+    const auto record = [&ran](char c) { return [&ran, c]() -> int { ran += c; return 0; }; };
+
+    for (uint32_t capacity = 0; capacity <= 64; capacity += 64)
+    {
+        ran.clear();
+        Gate gate(pool);
+        MailboxOptions options;
+        options.capacity = capacity;
+        Actor actor(pool, Actor::DEFAULT_QUOTA, options);
+
+        for (int i = 0; i != 20; ++i) actor.execJobAsync(record('L'), LOW_LANE);
+        for (int i = 0; i != 20; ++i) actor.execJobAsync(record('N'));
+        actor.execJobAsync(record('H'), HIGH_LANE);
+        actor.execJobAsync(record('X'), HIGH_LANE, chrono::steady_clock::now() - chrono::milliseconds(1));
+
+        gate.release();
+        actor.execJobSync([]() -> int { return 0; }, LOW_LANE);
+        assert(ran.substr(0, 11) == "HNNNNLNNNNL");
+        assert(std::count(ran.begin(), ran.end(), 'N') == 20 && std::count(ran.begin(), ran.end(), 'L') == 20);
+        assert(ran.find('X') == std::string::npos && actor.expiredJobs() == 1);
+    }
+
+    MailboxOptions options;
+    options.expiry = MailboxOptions::RUN_LATE;
+    Actor actor(pool, Actor::DEFAULT_QUOTA, options);
+    bool late = false;
+    actor.execJobAsync([&late]() -> int { late = Actor::late(); return 0; }, NORMAL_LANE, chrono::steady_clock::now());
+    assert(actor.execJobSync([]() -> int { return Actor::late(); }) == 0);
+    assert(late && actor.expiredJobs() == 1);
+    (void)late;
+}
+
+// Under cancelOnClose the closing job overtakes the backlog, and every user
+// job behind it is destroyed unrun, its waiting caller told so
+void checkCancelOnClose()
+{
+    Scheduler pool(1);
+    for (uint32_t capacity = 0; capacity <= 2048; capacity += 2048)
+    {
+        Gate gate(pool);
+        MailboxOptions options;
+        options.capacity = capacity;
+        options.cancelOnClose = true;
+        Actor* actor = new Actor(pool, Actor::DEFAULT_QUOTA, options);
+
+        atomic<int> ran(0);
+        for (int i = 0; i != 1000; ++i) actor->execJobAsync([&ran]() -> int { ran.fetch_add(1); return 0; });
+        atomic<bool> cancelled(false);
+        thread caller([&]()
+        {
+            try { actor->execJobSync([]() -> int { return 0; }); }
+            catch (const MailboxFull&) { cancelled.store(true); }
+        });
+        while (actor->d_pending.load() != 1001) this_thread::yield();
+
+        thread closer([actor]() { delete actor; });
+        while (actor->d_pending.load() != 1002) this_thread::yield();
+        gate.release();
+        closer.join();
+        caller.join();
+        assert(ran.load() == 0 && cancelled.load());
+    }
+}
+
+// Workers pinned by cpu or by NUMA node only ever run their actors there,
+// and mailboxes homed on a node work like any others
+void checkPlacement()
+{
+    // Nodes past the first word of the mbind mask, or past what the kernel
+    // knows, are refused and only lose the placement
+    int* far = newOnNode<int>(1024, 200);
+    far[1023] = 1;
+    assert(not preferNode(far, 1024 * sizeof(int), 200));
+    deleteOnNode(far, 1024, 200);
+
+    const std::vector<int> node0 = cpusOfNode(0);
+    if (node0.empty()) return;
+
+    int* near = newOnNode<int>(1024, 0);
+    assert(preferNode(near, 1024 * sizeof(int), 0));
+    deleteOnNode(near, 1024, 0);
+
+    SchedulerOptions byNode;
+    byNode.threads = 2;
+    byNode.nodes.push_back(0);
+    byNode.spinNanos = 20000;
+    SchedulerOptions byCpu;
+    byCpu.threads = 1;
+    byCpu.cpus.push_back(node0.back());
+
+    for (int pinning = 0; pinning != 2; ++pinning)
+    {
+        Scheduler pool(pinning ? byCpu : byNode);
+        MailboxOptions mailbox;
+        mailbox.node = 0;
+        Actor unbounded(pool, Actor::DEFAULT_QUOTA, mailbox);
+        mailbox.capacity = 16;
+        Actor bounded(pool, Actor::DEFAULT_QUOTA, mailbox);
+
+        for (Actor* actor : { &unbounded, &bounded })
+        {
+            atomic<int> strays(0);
+            int ran = 0;
+            for (int i = 0; i != 1000; ++i)
+                actor->execJobAsync([&]() -> int
+                {
+                    const int cpu = sched_getcpu();
+                    if (pinning ? cpu != node0.back() : std::find(node0.begin(), node0.end(), cpu) == node0.end())
+                        strays.fetch_add(1);
+                    ++ran;
+                    return 0;
+                });
+            assert(actor->execJobSync([&ran]() -> int { return ran; }) == 1000);
+            assert(strays.load() == 0);
+        }
+    }
+}
+
+// Request handler shape: fan out to every shard at once, then combine the
+// answers back on the home actor
+Task fanOut(Actor* home, std::vector<Actor*> shards, atomic<int>* result)
+{
+    std::deque<Call<int> > calls;
+    for (size_t i = 0; i != shards.size(); ++i)
+        calls.emplace_back(*shards[i], [i]() -> int { return int(i) + 1; });
+
+    int sum = 0;
+    for (size_t i = 0; i != calls.size(); ++i)
+    {
+        sum += co_await calls[i];
+        assert(Actor::s_current == home);
+    }
+
+    int touched = 0;
+    co_await shards[0]->call([&touched] { ++touched; });
+    assert(touched == 1 && Actor::s_current == home);
+
+    bool caught = false;
+    try { co_await shards[0]->call([]() -> int { throw std::runtime_error("shard failed"); }); }
+    catch (const std::runtime_error&) { caught = true; }
+    result->store(caught ? sum : -1);
+}
+
+// Many handlers in flight on one home actor, none of them blocking a thread
+void checkCoroutines()
+{
+    const int handlers = 100, shardCount = 8;
+    Scheduler pool(2);
+    Actor home(pool);
+    std::vector<Actor*> shards;
+    for (int i = 0; i != shardCount; ++i) shards.push_back(new Actor(pool));
+
+    std::vector<atomic<int> > results(handlers);
+    for (int h = 0; h != handlers; ++h)
+    {
+        results[h].store(0);
+        home.spawn(fanOut(&home, shards, &results[h]));
+    }
+
+    for (int h = 0; h != handlers; ++h)
+    {
+        while (results[h].load() == 0) this_thread::yield();
+        assert(results[h].load() == shardCount * (shardCount + 1) / 2);
+    }
+    for (int i = 0; i != shardCount; ++i) delete shards[i];
+}
+
+// Every heap allocation in the process, for checkNoAllocations
+static atomic<long> g_allocations(0);
+
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// Once the mail pool has grown to the number of jobs in flight, enqueue and
+// execute must not touch the heap. The first round holds the worker back so
+// the pool warms up to the most jobs any later round can have queued
+void checkNoAllocations()
+{
+    const int jobs = 10000;
+    Actor actor;
+    atomic<int> done(0);
+    atomic<bool> hold(true);
+
+    const auto round = [&]()
+    {
+        done.store(0);
+        for (int i = 0; i != jobs; ++i)
+            actor.execJobAsync([&done]() -> int { done.fetch_add(1, memory_order_relaxed); return 0; });
+        hold.store(false);
+        while (done.load() != jobs) this_thread::yield();
+    };
+
+    actor.execJobAsync([&hold]() -> int { while (hold.load()) this_thread::yield(); return 0; });
+    round();
+
+    const long before = g_allocations.load();
+    round();
+    round();
+    assert(g_allocations.load() == before);
+    (void)before;
+}
+
 int main()
 {
     using namespace std;
@@ -98,5 +2387,22 @@ int main()
         }
     }
     cout << "end" << endl;
-}
 
+    checkNoAllocations();
+    checkSyncCall();
+    checkBatch();
+    checkScheduler();
+    checkFairness();
+    checkMetrics();
+    checkCoroutines();
+    checkBoundedMailbox();
+    checkDropOldestNeverBlocks();
+    checkPriorityLanes();
+    checkCancelOnClose();
+    checkPlacement();
+
+    benchmarkEnqueue();
+    benchmarkSyncCall();
+    benchmarkWakeup();
+    benchmarkManyActors();
+}
@@ -0,0 +1,328 @@
+//Compile - g++ -std=c++20 -O3 -march=native -fopenmp constexpr-openmp-soa.cpp -o soa && ./soa [records] [reps]
+// Millions of CRAZY_PANTS at once: one aligned column per field, cores over
+// chunks of records and omp simd within each chunk, scaling from 1 to N threads
+
+#include "constexpr-openmp.cpp"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <utility>
+#include <vector>
+
+//Records per chunk, a multiple of 16 lanes so every chunk starts on a cache line
+constexpr std::size_t PANTS_CHUNK = 4096;
+
+//Structure of arrays for records of FIELDS lanes, field f of record i is
+//column(f)[i]. All columns share one 64-byte aligned block, each padded to
+//whole chunks, and the block is only reallocated when a resize outgrows it
+template<class T, std::size_t FIELDS>
+class soa_records{
+    static constexpr std::size_t ALIGN = 64;
+
+    T* d_data = nullptr;
+    std::size_t d_size = 0;
+    std::size_t d_stride = 0;  //records each column has room for
+
+    void release(){
+        if (d_data) ::operator delete(d_data, std::align_val_t(ALIGN));
+        d_data = nullptr;
+    }
+
+public:
+    soa_records() = default;
+    explicit soa_records(std::size_t n){ resize(n); }
+    ~soa_records(){ release(); }
+
+    soa_records(soa_records&& other)
+        : d_data(std::exchange(other.d_data, nullptr)), d_size(std::exchange(other.d_size, 0)),
+          d_stride(std::exchange(other.d_stride, 0)) {}
+    soa_records& operator=(soa_records&& other){
+        std::swap(d_data, other.d_data);
+        std::swap(d_size, other.d_size);
+        std::swap(d_stride, other.d_stride);
+        return *this;
+    }
+    soa_records(const soa_records&) = delete;
+    soa_records& operator=(const soa_records&) = delete;
+
+    //Records kept across a resize keep their values, new ones start at zero,
+    //also when a shrink is regrown within the block. On reallocation the
+    //zeroing runs under the same static chunk schedule as the kernels, so
+    //each thread first-touches the pages it will work on
+    void resize(std::size_t n){
+        if (n > d_stride) {
+            const std::size_t stride = (n + PANTS_CHUNK - 1) / PANTS_CHUNK * PANTS_CHUNK;
+            T* data = static_cast<T*>(::operator new(FIELDS * stride * sizeof(T), std::align_val_t(ALIGN)));
+            const std::size_t kept = d_size, chunks = stride / PANTS_CHUNK;
+
+            #pragma omp parallel for schedule(static)
+            for(std::size_t CHUNK = 0; CHUNK < chunks; CHUNK++){
+                const std::size_t begin = CHUNK * PANTS_CHUNK, end = begin + PANTS_CHUNK;
+                for(std::size_t FIELD = 0; FIELD < FIELDS; FIELD++){
+                    T* dst = data + FIELD * stride;
+                    const std::size_t copied = std::clamp(kept, begin, end);
+                    if (copied > begin) std::memcpy(dst + begin, d_data + FIELD * d_stride + begin, (copied - begin) * sizeof(T));
+                    std::fill(dst + copied, dst + end, T());
+                }
+            }
+            release();
+            d_data = data;
+            d_stride = stride;
+        }else if (n > d_size) {
+            for(std::size_t FIELD = 0; FIELD < FIELDS; FIELD++){
+                std::fill(column(FIELD) + d_size, column(FIELD) + n, T());
+            }
+        }
+        d_size = n;
+    }
+
+    std::size_t size() const { return d_size; }
+
+    T* column(std::size_t field){ return d_data + field * d_stride; }
+    const T* column(std::size_t field) const { return d_data + field * d_stride; }
+
+    fixed_vec<T, FIELDS> record(std::size_t INDEX) const {
+        fixed_vec<T, FIELDS> result{};
+        for(std::size_t FIELD = 0; FIELD < FIELDS; FIELD++){
+            result[FIELD] = column(FIELD)[INDEX];
+        }
+        return result;
+    }
+
+    void set_record(std::size_t INDEX, const fixed_vec<T, FIELDS>& x){
+        for(std::size_t FIELD = 0; FIELD < FIELDS; FIELD++){
+            column(FIELD)[INDEX] = x[FIELD];
+        }
+    }
+};
+
+typedef soa_records<float, 10> PANTS_SOA;
+
+constexpr fixed_vec<float, 10> as_vec(const CRAZY_PANTS& x){
+    fixed_vec<float, 10> result{};
+    for(int INDEX = 0; INDEX < 10; INDEX++){
+        result[INDEX] = x.pants[INDEX];
+    }
+    return result;
+}
+
+constexpr CRAZY_PANTS as_pants(const fixed_vec<float, 10>& x){
+    CRAZY_PANTS result{};
+    for(int INDEX = 0; INDEX < 10; INDEX++){
+        result.pants[INDEX] = x[INDEX];
+    }
+    return result;
+}
+
+//One chunk of one column, every pointer starts on a cache line. dst may be
+//one of srcs, so nothing is __restrict; omp simd still vectorizes since
+//each element reads only its own index
+template<class T, class Op, class... Srcs>
+void chunk_transform(Op op, std::size_t count, T* dst, const Srcs*... srcs){
+    #pragma omp simd
+    for(std::size_t INDEX = 0; INDEX < count; INDEX++){
+        dst[INDEX] = op(srcs[INDEX]...);
+    }
+}
+
+template<class T>
+T* chunk_at(T* column, std::size_t begin){
+    return static_cast<T*>(__builtin_assume_aligned(column + begin, 64));
+}
+
+//out[f][i] = op(ins[f][i]...) for every field of every record, out is
+//resized to match and may be one of the inputs
+template<class T, std::size_t FIELDS, class Op, class... Ins>
+void transform(soa_records<T, FIELDS>& out, Op op, const soa_records<T, FIELDS>& first, const Ins&... rest){
+    const std::size_t n = first.size(), chunks = (n + PANTS_CHUNK - 1) / PANTS_CHUNK;
+    if (((rest.size() != n) || ...)) std::abort();
+    out.resize(n);
+
+    #pragma omp parallel for schedule(static)
+    for(std::size_t CHUNK = 0; CHUNK < chunks; CHUNK++){
+        const std::size_t begin = CHUNK * PANTS_CHUNK, count = std::min(PANTS_CHUNK, n - begin);
+        for(std::size_t FIELD = 0; FIELD < FIELDS; FIELD++){
+            chunk_transform(op, count, chunk_at(out.column(FIELD), begin),
+                chunk_at(first.column(FIELD), begin), chunk_at(rest.column(FIELD), begin)...);
+        }
+    }
+}
+
+//make_pants_big for every record at once
+inline void make_all_pants_big(PANTS_SOA& out, const PANTS_SOA& x, const PANTS_SOA& y){
+    transform(out, [](float a, float b){ return a + b; }, x, y);
+}
+
+//How transform_reduce folds, each with the omp simd reduction clause to match
+struct reduce_plus{};
+struct reduce_min{};
+struct reduce_max{};
+
+//Infinities where T has them, so a column of infinities folds to itself
+template<class T, class Reduce>
+constexpr T reduce_identity(){
+    using limits = std::numeric_limits<T>;
+    if constexpr (std::is_same_v<Reduce, reduce_plus>) return T();
+    else if constexpr (std::is_same_v<Reduce, reduce_min>) return limits::has_infinity ? limits::infinity() : limits::max();
+    else return limits::has_infinity ? -limits::infinity() : limits::lowest();
+}
+
+template<class Reduce, class T>
+T reduce_combine(T a, T b){
+    if constexpr (std::is_same_v<Reduce, reduce_plus>) return a + b;
+    else if constexpr (std::is_same_v<Reduce, reduce_min>) return b < a ? b : a;
+    else return a < b ? b : a;
+}
+
+template<class Reduce, class T, class Op, class... Srcs>
+T chunk_reduce(Op op, std::size_t count, const Srcs* __restrict... srcs){
+    T acc = reduce_identity<T, Reduce>();
+    if constexpr (std::is_same_v<Reduce, reduce_plus>) {
+        #pragma omp simd reduction(+:acc)
+        for(std::size_t INDEX = 0; INDEX < count; INDEX++){
+            acc += op(srcs[INDEX]...);
+        }
+    }else if constexpr (std::is_same_v<Reduce, reduce_min>) {
+        #pragma omp simd reduction(min:acc)
+        for(std::size_t INDEX = 0; INDEX < count; INDEX++){
+            const T x = op(srcs[INDEX]...);
+            acc = x < acc ? x : acc;
+        }
+    }else{
+        #pragma omp simd reduction(max:acc)
+        for(std::size_t INDEX = 0; INDEX < count; INDEX++){
+            const T x = op(srcs[INDEX]...);
+            acc = acc < x ? x : acc;
+        }
+    }
+    return acc;
+}
+
+//Per field, Reduce over every record of op(ins[f][i]...). Each thread folds
+//its chunks locally and merges once, so there is no per-call scratch; a
+//parallel sum adds in a different order from a serial one
+template<class Reduce, class T, std::size_t FIELDS, class Op, class... Ins>
+fixed_vec<T, FIELDS> transform_reduce(Op op, const soa_records<T, FIELDS>& first, const Ins&... rest){
+    const std::size_t n = first.size(), chunks = (n + PANTS_CHUNK - 1) / PANTS_CHUNK;
+    if (((rest.size() != n) || ...)) std::abort();
+    fixed_vec<T, FIELDS> total = fixed_vec<T, FIELDS>::broadcast(reduce_identity<T, Reduce>());
+
+    #pragma omp parallel
+    {
+        fixed_vec<T, FIELDS> local = fixed_vec<T, FIELDS>::broadcast(reduce_identity<T, Reduce>());
+
+        #pragma omp for schedule(static) nowait
+        for(std::size_t CHUNK = 0; CHUNK < chunks; CHUNK++){
+            const std::size_t begin = CHUNK * PANTS_CHUNK, count = std::min(PANTS_CHUNK, n - begin);
+            for(std::size_t FIELD = 0; FIELD < FIELDS; FIELD++){
+                local[FIELD] = reduce_combine<Reduce>(local[FIELD], chunk_reduce<Reduce, T>(op, count,
+                    chunk_at(first.column(FIELD), begin), chunk_at(rest.column(FIELD), begin)...));
+            }
+        }
+
+        #pragma omp critical
+        for(std::size_t FIELD = 0; FIELD < FIELDS; FIELD++){
+            total[FIELD] = reduce_combine<Reduce>(total[FIELD], local[FIELD]);
+        }
+    }
+    return total;
+}
+
+//Mean seconds per call of kernel over reps calls, after one warm-up call
+template<class Kernel>
+double seconds_per_call(int reps, Kernel kernel){
+    kernel();
+    const auto start = std::chrono::steady_clock::now();
+    for(int REP = 0; REP < reps; REP++){
+        kernel();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / reps;
+}
+
+int main(int argc, char** argv){
+    const std::size_t records = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4000000;
+    const int reps = argc > 2 ? std::atoi(argv[2]) : 10;
+    const int max_threads = omp_get_max_threads();
+    if (reps < 1) {
+        std::fprintf(stderr, "reps must be at least 1\n");
+        return 1;
+    }
+
+    PANTS_SOA x(records), y(records), out;
+    for(std::size_t INDEX = 0; INDEX < records; INDEX++){
+        x.set_record(INDEX, as_vec(set1) * float(INDEX % 7));
+        y.set_record(INDEX, as_vec(enlarge_pants_compile_time) + float(INDEX % 3));
+    }
+
+    //Parallel kernels against the single-record functions and a serial sum
+    make_all_pants_big(out, x, y);
+    int bad = 0;
+    for(std::size_t INDEX = 0; INDEX < records; INDEX += records / 97 + 1){
+        bad += !all(out.record(INDEX) == as_vec(runtime_make_pants_big(as_pants(x.record(INDEX)), as_pants(y.record(INDEX)))));
+    }
+    const fixed_vec<float, 10> dots = transform_reduce<reduce_plus>([](float a, float b){ return a * b; }, x, y);
+    const fixed_vec<float, 10> lows = transform_reduce<reduce_min>([](float a){ return a; }, out);
+    const fixed_vec<float, 10> highs = transform_reduce<reduce_max>(
+        [](float){ return -std::numeric_limits<float>::infinity(); }, x);
+    bad += !all(highs == fixed_vec<float, 10>::broadcast(-std::numeric_limits<float>::infinity()));
+    for(std::size_t FIELD = 0; FIELD < 10; FIELD++){
+        double serial = 0;
+        float low = std::numeric_limits<float>::infinity();
+        for(std::size_t INDEX = 0; INDEX < records; INDEX++){
+            serial += double(x.column(FIELD)[INDEX]) * y.column(FIELD)[INDEX];
+            low = std::min(low, out.column(FIELD)[INDEX]);
+        }
+        bad += std::fabs(dots[FIELD] - serial) > 1e-3 * std::fabs(serial) + 1e-3;
+        bad += lows[FIELD] != low;
+    }
+    //In place, out is the destination and the only input
+    transform(out, [](float a){ return a * 2; }, out);
+    for(std::size_t INDEX = 0; INDEX < records; INDEX += records / 97 + 1){
+        bad += !all(out.record(INDEX) == as_vec(runtime_make_pants_big(as_pants(x.record(INDEX)), as_pants(y.record(INDEX)))) * 2.f);
+    }
+
+    //Records dropped by a shrink come back as zero
+    out.resize(records / 2);
+    out.resize(records);
+    if (records > 0) {
+        bad += !all(out.record(records - 1) == fixed_vec<float, 10>::broadcast(0.f));
+    }
+    if (bad) {
+        std::printf("%d mismatches\n", bad);
+        return 1;
+    }
+
+    //Both kernels stream every column once, add reads two records and writes one
+    const double add_bytes = 3.0 * records * sizeof(CRAZY_PANTS), dot_bytes = 2.0 * records * sizeof(CRAZY_PANTS);
+    std::vector<int> threads;
+    for(int T = 1; T < max_threads; T *= 2){
+        threads.push_back(T);
+    }
+    threads.push_back(max_threads);
+
+    std::printf("%zu records, %d reps\n", records, reps);
+    std::printf("threads,add ms,add GB/s,add efficiency,dot ms,dot GB/s,dot efficiency\n");
+    double add_one = 0, dot_one = 0;
+    for(const int T : threads){
+        omp_set_num_threads(T);
+        const double add = seconds_per_call(reps, [&]{ make_all_pants_big(out, x, y); });
+        const double dot = seconds_per_call(reps, [&]{
+            transform_reduce<reduce_plus>([](float a, float b){ return a * b; }, x, y);
+        });
+        if (T == 1) {
+            add_one = add;
+            dot_one = dot;
+        }
+        std::printf("%d,%.3f,%.2f,%.2f,%.3f,%.2f,%.2f\n", T,
+            add * 1e3, add_bytes / add / 1e9, add_one / (T * add),
+            dot * 1e3, dot_bytes / dot / 1e9, dot_one / (T * dot));
+    }
+}
@@ -1,3 +1,7 @@
+//Compile - g++ -std=c++20 -O3 -march=native -fopenmp-simd -c constexpr-openmp.cpp
+#include <cstddef>
+#include <type_traits>
+
 struct CRAZY_PANTS{
     float pants[10];
 };
@@ -45,3 +49,294 @@ constexpr CRAZY_PANTS make_pants_big(CRAZY_PANTS x, CRAZY_PANTS y){
     CRAZY_PANTS res_plain {make_pants_big(set1,set2)};
 
 
+//Pants in any size and any cloth: fixed_vec<T, N> does for every operation what
+//make_pants_big does for add. During constant evaluation each operation takes
+//the plain scalar loop, at runtime the omp simd loop, and the compiler peels
+//the N % lanes tail of that loop itself so any N is fine
+template<class T, std::size_t N>
+struct fixed_vec{
+    static_assert(N > 0, "a fixed_vec needs at least one lane");
+
+    T lanes[N];
+
+    constexpr T& operator[](std::size_t INDEX){ return lanes[INDEX]; }
+    constexpr const T& operator[](std::size_t INDEX) const { return lanes[INDEX]; }
+
+    static constexpr fixed_vec broadcast(T x){
+        fixed_vec result{};
+        for(std::size_t INDEX = 0; INDEX < N; INDEX++){
+            result.lanes[INDEX] = x;
+        }
+        return result;
+    }
+};
+
+template<class R, std::size_t N, class Op, class... Ts>
+fixed_vec<R, N> runtime_lanewise(Op op, const fixed_vec<Ts, N>&... xs){
+    fixed_vec<R, N> result{};
+
+    #pragma omp simd
+    for(std::size_t INDEX = 0; INDEX < N; INDEX++){
+        result.lanes[INDEX] = op(xs.lanes[INDEX]...);
+    }
+    return result;
+}
+
+//op applied lane by lane across one or more vectors
+template<class R, std::size_t N, class Op, class... Ts>
+constexpr fixed_vec<R, N> lanewise(Op op, const fixed_vec<Ts, N>&... xs){
+    if (__builtin_is_constant_evaluated()) {
+        fixed_vec<R, N> result{};
+
+        for(std::size_t INDEX = 0; INDEX < N; INDEX++){
+            result.lanes[INDEX] = op(xs.lanes[INDEX]...);
+        }
+        return result;
+    }else{
+        return runtime_lanewise<R>(op, xs...);
+    }
+}
+
+//Fused for float and double on both paths, GCC folds the builtins at compile
+//time, so a table baked by the compiler matches the same call at runtime
+template<class T>
+constexpr T fused_multiply_add(T a, T b, T c){
+    if constexpr (std::is_same_v<T, float>) return __builtin_fmaf(a, b, c);
+    else if constexpr (std::is_same_v<T, double>) return __builtin_fma(a, b, c);
+    else return a * b + c;
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator-(const fixed_vec<T, N>& x){
+    return lanewise<T>([](T a){ return T(-a); }, x);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator+(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<T>([](T a, T b){ return T(a + b); }, x, y);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator-(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<T>([](T a, T b){ return T(a - b); }, x, y);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator*(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<T>([](T a, T b){ return T(a * b); }, x, y);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator/(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<T>([](T a, T b){ return T(a / b); }, x, y);
+}
+
+//A scalar on either side is broadcast to every lane
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator+(const fixed_vec<T, N>& x, std::type_identity_t<T> y){ return x + fixed_vec<T, N>::broadcast(y); }
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator+(std::type_identity_t<T> x, const fixed_vec<T, N>& y){ return fixed_vec<T, N>::broadcast(x) + y; }
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator-(const fixed_vec<T, N>& x, std::type_identity_t<T> y){ return x - fixed_vec<T, N>::broadcast(y); }
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator-(std::type_identity_t<T> x, const fixed_vec<T, N>& y){ return fixed_vec<T, N>::broadcast(x) - y; }
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator*(const fixed_vec<T, N>& x, std::type_identity_t<T> y){ return x * fixed_vec<T, N>::broadcast(y); }
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator*(std::type_identity_t<T> x, const fixed_vec<T, N>& y){ return fixed_vec<T, N>::broadcast(x) * y; }
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator/(const fixed_vec<T, N>& x, std::type_identity_t<T> y){ return x / fixed_vec<T, N>::broadcast(y); }
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> operator/(std::type_identity_t<T> x, const fixed_vec<T, N>& y){ return fixed_vec<T, N>::broadcast(x) / y; }
+
+template<class T, std::size_t N, class U>
+constexpr fixed_vec<T, N>& operator+=(fixed_vec<T, N>& x, const U& y){ return x = x + y; }
+template<class T, std::size_t N, class U>
+constexpr fixed_vec<T, N>& operator-=(fixed_vec<T, N>& x, const U& y){ return x = x - y; }
+template<class T, std::size_t N, class U>
+constexpr fixed_vec<T, N>& operator*=(fixed_vec<T, N>& x, const U& y){ return x = x * y; }
+template<class T, std::size_t N, class U>
+constexpr fixed_vec<T, N>& operator/=(fixed_vec<T, N>& x, const U& y){ return x = x / y; }
+
+//a * b + c in every lane, rounded once
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> fma(const fixed_vec<T, N>& a, const fixed_vec<T, N>& b, const fixed_vec<T, N>& c){
+    return lanewise<T>([](T x, T y, T z){ return fused_multiply_add(x, y, z); }, a, b, c);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> min(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<T>([](T a, T b){ return b < a ? b : a; }, x, y);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> max(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<T>([](T a, T b){ return a < b ? b : a; }, x, y);
+}
+
+//Comparisons give a mask, one bool per lane
+template<class T, std::size_t N>
+constexpr fixed_vec<bool, N> operator==(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<bool>([](T a, T b){ return a == b; }, x, y);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<bool, N> operator!=(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<bool>([](T a, T b){ return a != b; }, x, y);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<bool, N> operator<(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<bool>([](T a, T b){ return a < b; }, x, y);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<bool, N> operator<=(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<bool>([](T a, T b){ return a <= b; }, x, y);
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<bool, N> operator>(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return y < x;
+}
+
+template<class T, std::size_t N>
+constexpr fixed_vec<bool, N> operator>=(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return y <= x;
+}
+
+//Lanes of mask taken from x where it is set and from y elsewhere
+template<class T, std::size_t N>
+constexpr fixed_vec<T, N> select(const fixed_vec<bool, N>& mask, const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    return lanewise<T>([](bool m, T a, T b){ return m ? a : b; }, mask, x, y);
+}
+
+//Reductions. The simd path adds in a different order from the scalar one, so
+//floating point sums and dot products can differ in the last bits between a
+//compile time table and the same call at runtime; min and max never do
+template<class T, std::size_t N>
+T runtime_sum(const fixed_vec<T, N>& x){
+    T acc{};
+
+    #pragma omp simd reduction(+:acc)
+    for(std::size_t INDEX = 0; INDEX < N; INDEX++){
+        acc += x.lanes[INDEX];
+    }
+    return acc;
+}
+
+template<class T, std::size_t N>
+constexpr T sum(const fixed_vec<T, N>& x){
+    if (__builtin_is_constant_evaluated()) {
+        T acc{};
+
+        for(std::size_t INDEX = 0; INDEX < N; INDEX++){
+            acc += x.lanes[INDEX];
+        }
+        return acc;
+    }else{
+        return runtime_sum(x);
+    }
+}
+
+template<class T, std::size_t N>
+T runtime_dot(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    T acc{};
+
+    #pragma omp simd reduction(+:acc)
+    for(std::size_t INDEX = 0; INDEX < N; INDEX++){
+        acc += x.lanes[INDEX] * y.lanes[INDEX];
+    }
+    return acc;
+}
+
+template<class T, std::size_t N>
+constexpr T dot(const fixed_vec<T, N>& x, const fixed_vec<T, N>& y){
+    if (__builtin_is_constant_evaluated()) {
+        T acc{};
+
+        for(std::size_t INDEX = 0; INDEX < N; INDEX++){
+            acc += x.lanes[INDEX] * y.lanes[INDEX];
+        }
+        return acc;
+    }else{
+        return runtime_dot(x, y);
+    }
+}
+
+template<class T, std::size_t N>
+T runtime_min(const fixed_vec<T, N>& x){
+    T acc = x.lanes[0];
+
+    #pragma omp simd reduction(min:acc)
+    for(std::size_t INDEX = 1; INDEX < N; INDEX++){
+        acc = x.lanes[INDEX] < acc ? x.lanes[INDEX] : acc;
+    }
+    return acc;
+}
+
+template<class T, std::size_t N>
+constexpr T min(const fixed_vec<T, N>& x){
+    if (__builtin_is_constant_evaluated()) {
+        T acc = x.lanes[0];
+
+        for(std::size_t INDEX = 1; INDEX < N; INDEX++){
+            acc = x.lanes[INDEX] < acc ? x.lanes[INDEX] : acc;
+        }
+        return acc;
+    }else{
+        return runtime_min(x);
+    }
+}
+
+template<class T, std::size_t N>
+T runtime_max(const fixed_vec<T, N>& x){
+    T acc = x.lanes[0];
+
+    #pragma omp simd reduction(max:acc)
+    for(std::size_t INDEX = 1; INDEX < N; INDEX++){
+        acc = acc < x.lanes[INDEX] ? x.lanes[INDEX] : acc;
+    }
+    return acc;
+}
+
+template<class T, std::size_t N>
+constexpr T max(const fixed_vec<T, N>& x){
+    if (__builtin_is_constant_evaluated()) {
+        T acc = x.lanes[0];
+
+        for(std::size_t INDEX = 1; INDEX < N; INDEX++){
+            acc = acc < x.lanes[INDEX] ? x.lanes[INDEX] : acc;
+        }
+        return acc;
+    }else{
+        return runtime_max(x);
+    }
+}
+
+template<std::size_t N>
+constexpr bool all(const fixed_vec<bool, N>& mask){ return min(mask); }
+
+template<std::size_t N>
+constexpr bool any(const fixed_vec<bool, N>& mask){ return max(mask); }
+
+
+//Compile time stuff, any size! 11 lanes so the simd loops have a tail
+    typedef fixed_vec<float, 11> PANTS_11;
+
+    constexpr PANTS_11 waist{1.0f,2.0f,3.0f,4.0f,5.0f,6.0f,7.0f,8.0f,9.0f,10.0f,11.0f};
+    constexpr PANTS_11 hem = fma(waist, PANTS_11::broadcast(2.0f), -waist);
+
+    static_assert(all(hem == waist));
+    static_assert(sum(waist) == 66.0f && dot(waist, waist) == 506.0f);
+    static_assert(min(waist) == 1.0f && max(waist) == 11.0f);
+    static_assert(!any(max(waist, 12.0f - waist) < PANTS_11::broadcast(6.0f)));
+    static_assert(select(waist > PANTS_11::broadcast(6.0f), waist, -waist)[0] == -1.0f);
+
+    constexpr fixed_vec<int, 3> seams = fixed_vec<int, 3>{5, 7, 9} * 2 - 1;
+    PANTS_11 pants_table[sum(seams)] = {hem};
+
+//Runtime stuff, same calls!
+    PANTS_11 runtime_pants(PANTS_11 x, PANTS_11 y){
+        return fma(x, y, min(x, y)) / (sum(x) + 1.0f);
+    }
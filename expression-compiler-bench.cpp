@@ -0,0 +1,342 @@
+//Compile - g++ -std=c++2b -O3 -march=native -fopenmp-simd expression-compiler-bench.cpp -o bench && ./bench [--threshold 1.25] [--compile-time] [--header path]
+// Eval against hand-written C++, a naive tree-walking interpreter and Runtime_eval.
+// Exits non-zero when Eval's batch throughput falls behind the hand-written loop by more
+// than the threshold. Scalar calls cost a few ns each, too close to timer noise to gate on
+
+#define EXPRESSION_COMPILER_NO_MAIN
+#include "expression-compiler.cpp"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Recursive walk over the unoptimized AST, the baseline any compiler must beat
+class Naive_eval
+{
+    ast::Node_list d_ast;
+    std::string d_vars;
+
+    double walk(size_t i, const double* x) const
+    {
+        const ast::Node& n = d_ast.nodes[i];
+        switch (n.kind)
+        {
+        case ast::CONST: return n.value;
+        case ast::VAR: return x[n.lhs];
+        case ast::BINARY: return apply_op(n.op, walk(n.lhs, x), walk(n.rhs, x));
+        case ast::CALL:
+            return apply_fn(Fn(n.op), walk(n.lhs, x), ast::operands(n) > 1 ? walk(n.rhs, x) : 0.0);
+        }
+        return 0;
+    };
+
+public:
+    explicit Naive_eval(const Runtime_eval& r) : d_vars(r.vars())
+    { Parser{ r.name(), d_vars, d_ast }.run(); };
+
+    double operator()(const double* x) const { return walk(d_ast.root(), x); }
+};
+
+template <typename F, size_t...Is>
+inline double apply(const F& f, const double* x, std::index_sequence<Is...>)
+{ return f(x[Is]...); }
+
+// One expression, its hand-written twin and the source text of both
+template <size_t K, const_string S, auto Hand>
+struct Case
+{
+    static inline constexpr auto e = Eval<S>{};
+    static inline constexpr size_t arity = decltype(e)::arity;
+    using Is = std::make_index_sequence<arity>;
+
+    [[gnu::noinline]] static double eval(const double* x) { return apply(e, x, Is{}); }
+    [[gnu::noinline]] static double hand(const double* x) { return apply(Hand, x, Is{}); }
+
+    [[gnu::noinline]] static void eval_batch(
+        const std::array<std::span<const double>, arity>& in, std::span<double> out)
+    { e.eval_batch(in, out); }
+
+    [[gnu::noinline]] static void hand_batch(
+        const std::array<std::span<const double>, arity>& in, std::span<double> out)
+    {
+        [&]<size_t...Js>(std::index_sequence<Js...>)
+        {
+            #pragma omp simd
+            for (size_t i = 0; i < out.size(); ++i) out[i] = Hand(in[Js][i]...);
+        }
+        (Is{});
+    }
+};
+
+#define BENCH_CASE(K, NAME, EXPR, PARAMS, BODY) \
+    Bench_case{ NAME, EXPR, "[]" #PARAMS " { return " #BODY "; }", \
+        run_case<Case<K, EXPR, [] PARAMS { return BODY; }>> }
+
+struct Result
+{
+    size_t arity;
+    double eval_ns, hand_ns, vm_ns, naive_ns;  // per row, scalar calls
+    double eval_rows, hand_rows, vm_rows;      // rows per second, batch
+    double batch_ratio;                        // median of hand / eval throughput per rep
+};
+
+struct Bench_case
+{
+    const char* name;
+    const char* expr;
+    const char* hand_src;
+    Result (*run)(const char* expr);
+};
+
+static inline constexpr int reps = 21;
+
+template <typename F>
+double seconds(F&& f)
+{
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+double median(std::array<double, reps> t)
+{
+    std::nth_element(t.begin(), t.begin() + reps / 2, t.end());
+    return t[reps / 2];
+}
+
+// Median of several timed passes, each long enough to swamp the clock
+template <typename F>
+double median_seconds(F&& f)
+{
+    std::array<double, reps> t;
+    for (double& s : t) s = seconds(f);
+    return median(t);
+}
+
+// Passes of f and g alternate, so a frequency change or a noisy neighbour 
+// hits both sides of each ratio alike. Medians of f, g and f / g
+template <typename F, typename G>
+std::array<double, 3> paired_seconds(F&& f, G&& g)
+{
+    std::array<double, reps> tf, tg, ratio;
+    for (int rep = 0; rep < reps; ++rep)
+    {
+        tf[rep] = seconds(f);
+        tg[rep] = seconds(g);
+        ratio[rep] = tf[rep] / tg[rep];
+    }
+    return { median(tf), median(tg), median(ratio) };
+}
+
+static volatile double g_sink;
+
+template <typename C>
+Result run_case(const char* expr)
+{
+    constexpr size_t N = C::arity, rows = 1 << 14, passes = 16;
+
+    std::vector<std::vector<double>> cols(N, std::vector<double>(rows));
+    std::vector<double> packed(rows * N);
+    for (size_t v = 0; v < N; ++v)
+        for (size_t i = 0; i < rows; ++i)
+            packed[i * N + v] = cols[v][i] = 1.0 + double((i * 7 + v * 13) % 97) / 31.0;
+
+    std::array<std::span<const double>, N> in;
+    for (size_t v = 0; v < N; ++v) in[v] = cols[v];
+    std::vector<std::span<const double>> in_rt(in.begin(), in.end());
+    std::vector<double> out(rows);
+
+    const Runtime_eval vm{ expr };
+    const Naive_eval naive{ vm };
+
+    const auto scalar = [&](auto&& f)
+    {
+        return [&, f]
+        {
+            double s = 0;
+            for (size_t p = 0; p < passes; ++p)
+                for (size_t i = 0; i < rows; ++i) s += f(&packed[i * N]);
+            g_sink = s;
+        };
+    };
+
+    const auto batch = [&](auto&& f)
+    {
+        return [&, f]
+        {
+            for (size_t p = 0; p < passes; ++p) f();
+            g_sink = out[rows / 2];
+        };
+    };
+
+    constexpr double per_row = 1e9 / (passes * rows);
+    const auto s = paired_seconds(scalar(C::eval), scalar(C::hand));
+    const auto b = paired_seconds(
+        batch([&] { C::hand_batch(in, out); }), batch([&] { C::eval_batch(in, out); }));
+
+    Result r;
+    r.arity = N;
+    r.eval_ns = s[0] * per_row;
+    r.hand_ns = s[1] * per_row;
+    r.vm_ns = median_seconds(scalar([&](const double* x) { return vm.eval({ x, N }); })) * per_row;
+    r.naive_ns = median_seconds(scalar([&](const double* x) { return naive(x); })) * per_row;
+    r.eval_rows = passes * rows / b[1];
+    r.hand_rows = passes * rows / b[0];
+    r.vm_rows = passes * rows / median_seconds(batch([&] { vm.eval_batch(in_rt, out); }));
+    r.batch_ratio = b[2];
+    return r;
+}
+
+// Instructions in the body of the first symbol whose demangled name
+// matches, read back from our own executable
+long instruction_count(const std::string& objdump, const std::regex& symbol)
+{
+    const std::string cmd = objdump + " -d -C --no-show-raw-insn " 
+        + fs::read_symlink("/proc/self/exe").string() + " 2>/dev/null";
+    FILE* p = popen(cmd.c_str(), "r");
+    if (not p) return -1;
+
+    long count = -1;
+    char* line = nullptr;
+    size_t cap = 0;
+    while (getline(&line, &cap, p) > 0)
+    {
+        const std::string_view l = line;
+        if (count < 0) { if (std::regex_search(line, symbol)) count = 0; }
+        else if (l == "\n") break;
+        else ++count;
+    }
+    free(line);
+    pclose(p);
+    return count;
+}
+
+// Wall time to compile a TU holding just this expression, 
+// the hand-written one goes without the expression compiler
+double compile_seconds(const std::string& call, const fs::path& header, bool with_header)
+{
+    const fs::path source = fs::temp_directory_path() / "expression-compiler-bench-tu.cpp";
+    {
+        std::ofstream tu(source);
+        if (with_header)
+            tu << "#define EXPRESSION_COMPILER_NO_MAIN\n"
+               << "#include \"" << header.string() << "\"\n";
+        else tu << "#include <cmath>\n";
+        tu << "double f(const double* x) { return " << call << "; }\n";
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        execlp("g++", "g++", "-std=c++2b", "-O3", "-march=native", "-fopenmp-simd", "-c",
+            source.c_str(), "-o", "/dev/null", nullptr);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    fs::remove(source);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed.count() : -1;
+}
+
+int main(int argc, char** argv)
+{
+    double threshold = 1.25;
+    bool compile_time = false;
+    fs::path header = fs::path(__FILE__).parent_path() / "expression-compiler.cpp";
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string a = argv[i];
+        if (a == "--threshold" && i + 1 < argc) threshold = std::strtod(argv[++i], nullptr);
+        else if (a == "--compile-time") compile_time = true;
+        else if (a == "--header" && i + 1 < argc) header = argv[++i];
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--threshold R] [--compile-time] [--header path]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // __FILE__ is as given on the compile line, so relative paths only
+    // resolve from the directory the bench was built in
+    header = fs::absolute(header);
+    if (compile_time && not fs::exists(header))
+    {
+        std::cerr << header.string() << " not found, pass --header <path to expression-compiler.cpp>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const Bench_case cases[] = {
+        BENCH_CASE(0, "small", "a * b + c",
+            (double a, double b, double c), a * b + c),
+        BENCH_CASE(1, "poly", "x ^ 4 - 3 * x ^ 2 + 2 * x - 7",
+            (double x), x * x * x * x - 3 * x * x + 2 * x - 7),
+        BENCH_CASE(2, "shared", "(a + b) * (a - b) / (a + b + c) + (a + b) * c",
+            (double a, double b, double c), (a + b) * (a - b) / (a + b + c) + (a + b) * c),
+        BENCH_CASE(3, "wide", "a * b + c * d - e * f + g * h - i / j",
+            (double a, double b, double c, double d, double e, double f, double g, double h, double i, double j),
+            a * b + c * d - e * f + g * h - i / j),
+        BENCH_CASE(4, "deep", "a + b * (c - d * (e + f * (g - h * (a + b * (c - d)))))",
+            (double a, double b, double c, double d, double e, double f, double g, double h),
+            a + b * (c - d * (e + f * (g - h * (a + b * (c - d)))))),
+        BENCH_CASE(5, "math", "exp(-a * a) * sqrt(b) + log(c + 1)",
+            (double a, double b, double c), std::exp(-a * a) * std::sqrt(b) + std::log(c + 1)),
+    };
+
+    const char* objdump = std::getenv("OBJDUMP") ? std::getenv("OBJDUMP") : "objdump";
+
+    std::printf("%-7s %9s %9s %9s %9s %10s %10s %10s %7s %7s %8s %8s\n",
+        "case", "eval ns", "hand ns", "vm ns", "naive ns", "eval Mr/s", "hand Mr/s", "vm Mr/s",
+        "eval in", "hand in", "eval ct", "hand ct");
+
+    bool regressed = false;
+    for (size_t k = 0; k < std::size(cases); ++k)
+    {
+        const Bench_case& c = cases[k];
+        const Result r = c.run(c.expr);
+
+        const std::string prefix = "<Case<" + std::to_string(k) + "ul,.*>::";
+        const long eval_in = instruction_count(objdump, std::regex(prefix + "eval\\(double const\\*\\)>:"));
+        const long hand_in = instruction_count(objdump, std::regex(prefix + "hand\\(double const\\*\\)>:"));
+
+        double eval_ct = 0, hand_ct = 0;
+        if (compile_time)
+        {
+            std::string args;
+            for (size_t v = 0; v < r.arity; ++v) args += (v ? ", x[" : "x[") + std::to_string(v) + "]";
+            eval_ct = compile_seconds(std::string("Eval<\"") + c.expr + "\">{}(" + args + ")", header, true);
+            hand_ct = compile_seconds(std::string(c.hand_src) + "(" + args + ")", header, false);
+        }
+
+        const bool slow = r.batch_ratio > threshold;
+        regressed |= slow;
+
+        std::printf("%-7s %9.2f %9.2f %9.2f %9.2f %10.1f %10.1f %10.1f %7ld %7ld %8.2f %8.2f%s\n",
+            c.name, r.eval_ns, r.hand_ns, r.vm_ns, r.naive_ns,
+            r.eval_rows / 1e6, r.hand_rows / 1e6, r.vm_rows / 1e6, eval_in, hand_in, eval_ct, hand_ct,
+            slow ? "  << regressed" : "");
+    }
+
+    if (regressed)
+        std::cerr << "Eval batch slower than hand-written code by more than " << threshold << "x" << std::endl;
+    return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//Compiler GCC12.2
+//Flags -std=c++2b -O3 -march=native -fopenmp-simd
@@ -0,0 +1,124 @@
+//Compile - g++ -std=c++2b -O2 expression-compiler-ctbench.cpp -o ctbench && ./ctbench [--header path] [compiler] [lengths...]
+// Build time and peak compiler RSS of Eval<"..."> against expression length.
+// The header is looked up next to this source unless --header names it
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct Sample
+{
+    double seconds;
+    long peak_kb;
+    bool ok;
+};
+
+// Cycles 26 variables through the four arithmetic operators,
+// with a parenthesised group every few terms
+std::string make_expression(size_t length)
+{
+    static constexpr char ops[] = { '+', '-', '*', '/' };
+    std::string e = "a";
+    for (size_t i = 1; e.size() < length; ++i)
+    {
+        e += ' ';
+        e += ops[i % 4];
+        e += ' ';
+        if (i % 5 == 0) e += "(x * y - z)";
+        else e += char('a' + i % 26);
+    }
+    return e;
+}
+
+Sample compile(const std::string& compiler, const fs::path& source)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        execlp(compiler.c_str(), compiler.c_str(), "-std=c++2b", "-O2", "-c",
+            source.c_str(), "-o", "/dev/null", nullptr);
+        _exit(127);
+    }
+
+    int status = 0;
+    rusage usage{};
+    wait4(pid, &status, 0, &usage);
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return { elapsed.count(), usage.ru_maxrss, WIFEXITED(status) && WEXITSTATUS(status) == 0 };
+}
+
+int main(int argc, char** argv)
+{
+    fs::path header = fs::path(__FILE__).parent_path() / "expression-compiler.cpp";
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.size() >= 2 && args[0] == "--header")
+    {
+        header = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+    }
+
+    // __FILE__ is as given on the compile line, so relative paths only
+    // resolve from the directory the tool was built in
+    header = fs::absolute(header);
+    if (not fs::exists(header))
+    {
+        std::cerr << header.string() << " not found, pass --header <path to expression-compiler.cpp>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::string compiler = args.size() > 0 ? args[0] : "g++";
+    std::vector<size_t> lengths = { 0, 25, 50, 100, 200, 300, 400 };
+    if (args.size() > 1)
+    {
+        lengths.clear();
+        for (size_t i = 1; i < args.size(); ++i) lengths.push_back(std::strtoul(args[i].c_str(), nullptr, 10));
+    }
+
+    const fs::path source = fs::temp_directory_path() / "expression-compiler-ctbench-tu.cpp";
+
+    std::cout << "length,seconds,peak_rss_mb" << std::endl;
+    for (const size_t length : lengths)
+    {
+        // Length 0 measures the header alone
+        std::ofstream tu(source);
+        tu << "#define EXPRESSION_COMPILER_NO_MAIN\n"
+           << "#include \"" << header.string() << "\"\n";
+        if (length > 0)
+            tu << "int main() {\n"
+               << "    constexpr auto e = Eval<\"" << make_expression(length) << "\">{};\n"
+               << "    return [&]<size_t...I>(std::index_sequence<I...>)\n"
+               << "    { return int(e(double(I + 1)...)); }\n"
+               << "    (std::make_index_sequence<decltype(e)::arity>{});\n"
+               << "}\n";
+        else tu << "int main() {}\n";
+        tu.close();
+
+        const Sample s = compile(compiler, source);
+        if (not s.ok)
+        {
+            std::cerr << "compilation failed at length " << length << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::printf("%zu,%.2f,%.1f\n", length, s.seconds, s.peak_kb / 1024.0);
+    }
+
+    fs::remove(source);
+}
+
+//Compiler GCC12.2
+//Flags -std=c++2b -O2
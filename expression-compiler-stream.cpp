@@ -0,0 +1,290 @@
+//Compile - g++ -std=c++2b -O3 -march=native -fopenmp-simd -pthread expression-compiler-stream.cpp -o stream && ./stream <dir> [rows] [threads]
+// Out-of-core Eval over memory-mapped column files, one raw file per variable
+
+#define EXPRESSION_COMPILER_NO_MAIN
+#include "expression-compiler.cpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <numeric>
+#include <system_error>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+class Mapped_file
+{
+    int d_fd = -1;
+    std::byte* d_data = nullptr;
+    size_t d_size = 0;
+
+    [[noreturn]] static void fail(const fs::path& p, const char* what)
+    { throw std::system_error(errno, std::generic_category(), p.string() + ": " + what); }
+
+    // mmap rejects a zero length, an empty file stays unmapped and views as empty
+    void map(const fs::path& p, int prot)
+    {
+        if (d_size == 0) return;
+        void* m = ::mmap(nullptr, d_size, prot, MAP_SHARED, d_fd, 0);
+        if (m == MAP_FAILED) fail(p, "mmap");
+        d_data = static_cast<std::byte*>(m);
+    };
+
+public:
+    // Maps an existing file read-only
+    explicit Mapped_file(const fs::path& p)
+    {
+        d_fd = ::open(p.c_str(), O_RDONLY);
+        if (d_fd < 0) fail(p, "open");
+
+        struct stat st{};
+        if (::fstat(d_fd, &st) != 0) fail(p, "fstat");
+        d_size = st.st_size;
+        map(p, PROT_READ);
+    };
+
+    // Creates or truncates the file to size bytes and maps it read-write
+    Mapped_file(const fs::path& p, size_t size)
+    {
+        d_fd = ::open(p.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (d_fd < 0) fail(p, "open");
+
+        if (::ftruncate(d_fd, size) != 0) fail(p, "ftruncate");
+        d_size = size;
+        map(p, PROT_READ | PROT_WRITE);
+    };
+
+    Mapped_file(const Mapped_file&) = delete;
+    Mapped_file& operator=(const Mapped_file&) = delete;
+
+    ~Mapped_file()
+    {
+        if (d_data) ::munmap(d_data, d_size);
+        if (d_fd >= 0) ::close(d_fd);
+    };
+
+    size_t size() const { return d_size; }
+
+    template <typename T>
+    std::span<T> as() const { return { reinterpret_cast<T*>(d_data), d_size / sizeof(T) }; }
+
+    // Page-aligned hint over [offset, offset + length), clamped to the mapping
+    void advise(size_t offset, size_t length, int advice) const
+    {
+        if (offset >= d_size) return;
+        ::madvise(d_data + offset, std::min(length, d_size - offset), advice);
+    };
+};
+
+struct Stream_options
+{
+    size_t threads = std::thread::hardware_concurrency();
+    size_t chunk_bytes = 1 << 20;  // all columns of one chunk, sized for L2
+    size_t lookahead = 4;          // chunks of readahead issued ahead of each worker
+    bool pin = true;               // pin workers so first-touch pages stay on their node
+};
+
+struct Stream_stats
+{
+    size_t rows;
+    size_t bytes;
+    double seconds;
+    double gbps;          // end to end, inputs read plus output written
+    double compute_gbps;  // same kernel over resident chunks, all threads at once
+    size_t pinned;        // workers whose affinity was set
+};
+
+// CPUs this process may run on, empty when the mask cannot be read
+inline std::vector<int> allowed_cpus()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if (::sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+        if (CPU_ISSET(c, &set)) cpus.push_back(c);
+    return cpus;
+}
+
+template <typename E, typename T = typename E::value_type>
+Stream_stats stream_eval(const E& e,
+    const std::array<fs::path, E::arity>& inputs, const fs::path& output,
+    Stream_options opt = {})
+{
+    constexpr size_t N = E::arity;
+    const size_t page = ::sysconf(_SC_PAGESIZE);
+    opt.threads = std::max<size_t>(1, opt.threads);
+
+    std::vector<std::unique_ptr<Mapped_file>> in;
+    for (const fs::path& p : inputs) in.push_back(std::make_unique<Mapped_file>(p));
+
+    const size_t rows = in.front()->size() / sizeof(T);
+    for (const auto& m : in)
+        if (m->size() / sizeof(T) != rows)
+            throw std::invalid_argument("input columns differ in length");
+
+    const Mapped_file out(output, rows * sizeof(T));
+    if (rows == 0) return { 0, 0, 0.0, 0.0, 0.0, 0 };
+    for (const auto& m : in) m->advise(0, m->size(), MADV_SEQUENTIAL);
+
+    // Whole pages per column so every hint lands on chunk boundaries
+    const size_t page_rows = page / sizeof(T);
+    const size_t chunk_rows = std::max(page_rows,
+        opt.chunk_bytes / ((N + 1) * sizeof(T)) / page_rows * page_rows);
+    const size_t chunks = (rows + chunk_rows - 1) / chunk_rows;
+    const size_t chunk_span = chunk_rows * sizeof(T);
+
+    const auto columns = [&](size_t c)
+    {
+        const size_t first = c * chunk_rows, n = std::min(chunk_rows, rows - first);
+        std::array<std::span<const T>, N> cols;
+        for (size_t v = 0; v < N; ++v) cols[v] = in[v]->template as<const T>().subspan(first, n);
+        return std::pair{ cols, out.as<T>().subspan(first, n) };
+    };
+
+    const auto prefetch = [&](size_t c)
+    {
+        if (c >= chunks) return;
+        for (const auto& m : in) m->advise(c * chunk_span, chunk_span, MADV_WILLNEED);
+    };
+
+    // Workers go round-robin over the CPUs of the process cpuset. Pinning
+    // is only a locality hint, a worker that cannot be pinned runs unpinned
+    const std::vector<int> cpus = opt.pin ? allowed_cpus() : std::vector<int>{};
+    const auto pin = [&](size_t t)
+    {
+        if (cpus.empty()) return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[t % cpus.size()], &set);
+        return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+    };
+    std::atomic<size_t> pinned = 0;
+
+    // Chunks are dealt round-robin, so each worker strides through the files
+    // and is the first to touch its share of the output
+    const auto worker = [&](size_t t)
+    {
+        if (pin(t)) ++pinned;
+
+        for (size_t k = 0; k < opt.lookahead; ++k) prefetch(t + k * opt.threads);
+        for (size_t c = t; c < chunks; c += opt.threads)
+        {
+            prefetch(c + opt.lookahead * opt.threads);
+
+            const auto [cols, dst] = columns(c);
+            e.eval_batch(cols, dst);
+
+            for (const auto& m : in) m->advise(c * chunk_span, chunk_span, MADV_DONTNEED);
+        }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> pool;
+        for (size_t t = 0; t < opt.threads; ++t) pool.emplace_back(worker, t);
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Compute ceiling, every worker pages a chunk back in and then all of them
+    // evaluate it while resident at once, so the figure is whatever the
+    // cpuset actually delivers to that many threads. Workers stamp their own
+    // start and end, the span runs from the first start to the last end
+    constexpr int reps = 16;
+    using clock = std::chrono::steady_clock;
+    std::barrier ready(opt.threads);
+    std::atomic<size_t> resident_bytes = 0;
+    std::vector<std::pair<clock::time_point, clock::time_point>> spans(opt.threads);
+    const auto ceiling = [&](size_t t)
+    {
+        pin(t);
+        const auto [cols, dst] = columns(t % chunks);
+        std::vector<T> scratch(dst.size());
+        e.eval_batch(cols, scratch);
+        resident_bytes += (N + 1) * dst.size_bytes();
+
+        ready.arrive_and_wait();
+        spans[t].first = clock::now();
+        for (int r = 0; r < reps; ++r) e.eval_batch(cols, scratch);
+        spans[t].second = clock::now();
+    };
+
+    {
+        std::vector<std::jthread> pool;
+        for (size_t t = 0; t < opt.threads; ++t) pool.emplace_back(ceiling, t);
+    }
+    const auto [first, last] = std::accumulate(spans.begin(), spans.end(), spans.front(),
+        [](auto a, const auto& b) { return std::pair{ std::min(a.first, b.first), std::max(a.second, b.second) }; });
+    const std::chrono::duration<double> dc = last - first;
+    const double compute_gbps = reps * resident_bytes / dc.count() / 1e9;
+
+    const size_t bytes = (N + 1) * rows * sizeof(T);
+    return { rows, bytes, elapsed.count(), bytes / elapsed.count() / 1e9, compute_gbps, pinned.load() };
+}
+
+// Writes rows of deterministic values into each input column
+void generate(const fs::path& dir, std::string_view vars, size_t rows)
+{
+    fs::create_directories(dir);
+    for (size_t v = 0; v < vars.size(); ++v)
+    {
+        const Mapped_file m(dir / (std::string(1, vars[v]) + ".bin"), rows * sizeof(double));
+        const std::span<double> col = m.as<double>();
+        for (size_t i = 0; i < rows; ++i) col[i] = double((i * (v + 7)) % 1021) / 17.0 + 1.0;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <dir> [rows] [threads]" << std::endl;
+        return 1;
+    }
+
+    const fs::path dir = argv[1];
+    const size_t rows = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1 << 24;
+    Stream_options opt;
+    if (argc > 3) opt.threads = std::strtoull(argv[3], nullptr, 10);
+
+    constexpr auto e = Eval<"a * b + c / (a + 1)">{};
+    constexpr std::string_view vars = "abc";
+    static_assert(e.arity == vars.size());
+
+    try
+    {
+        if (not fs::exists(dir / "a.bin")) generate(dir, vars, rows);
+
+        const Stream_stats s = stream_eval(e,
+            { dir / "a.bin", dir / "b.bin", dir / "c.bin" }, dir / "out.bin", opt);
+
+        if (s.rows == 0)
+        {
+            std::printf("%s: no rows, wrote an empty output\n", e.name().data());
+            return 0;
+        }
+
+        std::printf("%s: %zu rows, %.2f GB in %.3f s, %.2f GB/s (compute ceiling %.2f GB/s, %s bound, %zu workers pinned)\n",
+            e.name().data(), s.rows, s.bytes / 1e9, s.seconds, s.gbps, s.compute_gbps,
+            s.gbps < 0.8 * s.compute_gbps ? "I/O" : "compute", s.pinned);
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+}
+
+//Compiler GCC12.2
+//Flags -std=c++2b -O3 -march=native -fopenmp-simd -pthread
@@ -2,35 +2,35 @@
 #include <cstddef>
 #include <limits>
 #include <type_traits>
+#include <utility>
 
 // Type list impl
 namespace meta 
 {
     template <typename Ty> struct Type_wrapper { using type = Ty; };
 
+    // Constant-depth pack indexing, overload resolution picks the base
+    template <size_t I, typename Ty> struct Indexed {};
+
+    template <typename, typename...> struct Indexer;
+    template <size_t...Is, typename...TT>
+    struct Indexer <std::index_sequence<Is...>, TT...> : Indexed<Is, TT>... {};
+
+    template <size_t I, typename Ty>
+    consteval inline Type_wrapper<Ty> select(const Indexed<I, Ty>&) { return {}; };
+
     template <typename...TT>
     class Type_list
     {
-        template <size_t I = 0, size_t N, size_t C,
-            typename Ty, typename...UU>
-        static consteval inline auto get_at() {
-            static_assert(N < C, "Out of bounds");
-            if constexpr(I == N) return Type_wrapper<Ty>{};
-            else return get_at<I + 1, N, C, UU...>();
-        };
-
-        template <typename U, size_t I = 0, size_t C>
-        static consteval inline size_t locate_impl() {
+        template <typename U>
+        static consteval inline size_t locate_impl()
+        {
+            constexpr bool match[] = { std::same_as<U, TT>... };
+            for (size_t i = 0; i < sizeof...(TT); ++i) 
+                if (match[i]) return i;
             return std::numeric_limits<size_t>::max();
         };
 
-        template <typename U, size_t I = 0, size_t C,
-            typename T, typename...UU>
-        static consteval inline size_t locate_impl() {
-            if constexpr (std::same_as<U, T>) return I;
-            else return locate_impl<U, I + 1, C, UU...>();
-        };
-
         static inline constexpr size_t count_impl = sizeof...(TT);
 
     public:
@@ -46,20 +46,20 @@ namespace meta
         template <size_t N>
         static inline consteval auto get()
         {
-            return get_at<0, N, Type_list<TT...>::count_impl, TT...>();
+            static_assert(N < count_impl, "Out of bounds");
+            return select<N>(Indexer<std::index_sequence_for<TT...>, TT...>{});
         };
 
         template <typename Ty>
         static inline consteval bool exists()
         {
-            return locate_impl<Ty, 0, Type_list<TT...>::count_impl, TT...>() 
-                    != std::numeric_limits<size_t>::max();
+            return locate_impl<Ty>() != std::numeric_limits<size_t>::max();
         };
 
         template <typename Ty>
         static inline consteval size_t locate()
         {
-            return locate_impl<Ty, 0, Type_list<TT...>::count_impl, TT...>();
+            return locate_impl<Ty>();
         };
 
         template <bool B, typename...UU>
@@ -98,14 +98,16 @@ namespace meta
         { using type = Type_list <>; };
     };
 
-    template <typename List, typename T, typename...TT>
-    consteval inline auto tl_flip(meta::Type_list<T, TT...>)
+    template <typename List, typename...TT, size_t...Is>
+    consteval inline auto tl_flip(meta::Type_list<TT...> l, std::index_sequence<Is...>)
     {
-        return tl_flip<typename List::template prepend<T>::type>(meta::Type_list<TT...>{});
+        return typename List::template append<
+            typename decltype(l.template get<sizeof...(TT) - 1 - Is>())::type...>::type{};
     };
 
-    template <typename List>
-    consteval inline auto tl_flip(meta::Type_list<>) { return List{}; };
+    template <typename List, typename...TT>
+    consteval inline auto tl_flip(meta::Type_list<TT...> l)
+    { return tl_flip<List>(l, std::index_sequence_for<TT...>{}); };
 }
 
 template <typename...TT>
@@ -128,20 +130,25 @@ template <typename Ty> concept idxls_c = is_idxls<Ty>::value;
 
 
 
-// Token impl
+// Token impl, expr is generic over the element type and grad gives 
+// the partial derivatives of expr w.r.t. both operands
 enum Token_vs : size_t
 {
     CONSTANT,
     VARIABLE,
     OPERATOR,
     ENDOF,
-    WHITESPACE
+    WHITESPACE,
+    OPEN,
+    CLOSE,
+    SEPARATOR
 };
 
 template <char C> struct Token
 {
     static inline constexpr char tok = C;
-    static inline constexpr auto T_t = Token_vs::VARIABLE;
+    static inline constexpr auto T_t = 
+        (C >= '0' && C <= '9') || C == '.' ? Token_vs::CONSTANT : Token_vs::VARIABLE;
 };
 
 template <> struct Token<'\0'> {
@@ -154,48 +161,108 @@ template <> struct Token<' '> {
     static inline constexpr auto T_t = Token_vs::WHITESPACE;
 };
 
+template <> struct Token<'('> {
+    static inline constexpr char tok = '(';
+    static inline constexpr auto T_t = Token_vs::OPEN;
+};
+
+template <> struct Token<')'> {
+    static inline constexpr char tok = ')';
+    static inline constexpr auto T_t = Token_vs::CLOSE;
+};
+
+template <> struct Token<','> {
+    static inline constexpr char tok = ',';
+    static inline constexpr auto T_t = Token_vs::SEPARATOR;
+};
+
 template <> struct Token<'+'>  {
     static inline constexpr char tok = '+';
     static inline constexpr auto T_t = Token_vs::OPERATOR;
+    static inline constexpr size_t prec = 1;
+    static inline constexpr bool right_assoc = false;
+    static inline constexpr bool commutative = true;
     static inline constexpr auto expr = 
-        [](double _0, double _1) { return _0 + _1; };
+        [](auto _0, auto _1) { return _0 + _1; };
+    static inline constexpr auto grad = 
+        [](double, double) { return std::pair{ 1.0, 1.0 }; };
 };
 
 template <> struct Token<'-'> {
     static inline constexpr char tok = '-';
     static inline constexpr auto T_t = Token_vs::OPERATOR;
+    static inline constexpr size_t prec = 1;
+    static inline constexpr bool right_assoc = false;
     static inline constexpr auto expr = 
-        [](double _0, double _1) { return _0 - _1; };
+        [](auto _0, auto _1) { return _0 - _1; };
+    static inline constexpr auto grad = 
+        [](double, double) { return std::pair{ 1.0, -1.0 }; };
 };
 
 template <> struct Token<'*'> {
     static inline constexpr char tok = '*';
     static inline constexpr auto T_t = Token_vs::OPERATOR;
+    static inline constexpr size_t prec = 2;
+    static inline constexpr bool right_assoc = false;
+    static inline constexpr bool commutative = true;
     static inline constexpr auto expr = 
-        [](double _0, double _1) { return _0 * _1; };
+        [](auto _0, auto _1) { return _0 * _1; };
+    static inline constexpr auto grad = 
+        [](double _0, double _1) { return std::pair{ _1, _0 }; };
 };
 
 template <> struct Token<'/'> {
     static inline constexpr char tok = '/';
     static inline constexpr auto T_t = Token_vs::OPERATOR;
+    static inline constexpr size_t prec = 2;
+    static inline constexpr bool right_assoc = false;
     static inline constexpr auto expr = 
-        [](double _0, double _1) { return _0 / _1; };
+        [](auto _0, auto _1) { return _0 / _1; };
+    static inline constexpr auto grad = 
+        [](double _0, double _1) { return std::pair{ 1 / _1, -_0 / (_1 * _1) }; };
 };
 
+#include <cmath>
+
 template <> struct Token<'%'> {
     static inline constexpr char tok = '%';
     static inline constexpr auto T_t = Token_vs::OPERATOR;
+    static inline constexpr size_t prec = 2;
+    static inline constexpr bool right_assoc = false;
     static inline constexpr auto expr = 
-        [](double _0, double _1) { return (long)_0 % (long)_1; };
+        [](auto _0, auto _1) 
+        {
+            if constexpr (std::is_integral_v<decltype(_0)>) return _0 % _1;
+            else { using std::fmod; return fmod(_0, _1); }
+        };
+    static inline constexpr auto grad = 
+        [](double _0, double _1) { return std::pair{ 1.0, -std::trunc(_0 / _1) }; };
 };
 
-#include <cmath>
-
 template <> struct Token<'^'> {
     static inline constexpr char tok = '^';
     static inline constexpr auto T_t = Token_vs::OPERATOR;
+    static inline constexpr size_t prec = 3;
+    static inline constexpr bool right_assoc = true;
     static inline constexpr auto expr = 
-        [](double _0, double _1) { return pow(_0, _1); };
+        [](auto _0, auto _1) 
+        {
+            using T = decltype(_0);
+            if constexpr (std::is_integral_v<T>)
+            {
+                T r = 1;
+                for (T e = _1 < 0 ? -_1 : _1; e > 0; e >>= 1)
+                {
+                    if (e & 1) r *= _0;
+                    if (e > 1) _0 *= _0;
+                }
+                return _1 < 0 ? T(1) / r : r;
+            }
+            else { using std::pow; return pow(_0, _1); }
+        };
+    static inline constexpr auto grad = 
+        [](double _0, double _1) 
+        { return std::pair{ _1 * pow(_0, _1 - 1), _0 > 0 ? pow(_0, _1) * log(_0) : 0.0 }; };
 };
 
 template <typename> struct is_tokls : std::false_type {};
@@ -209,6 +276,435 @@ template <typename Ty> concept tokls_c = is_tokls<Ty>::value;
 
 
 
+// Token table lookups by character value
+#include <array>
+#include <string_view>
+
+using Operator_table = meta::Type_list<
+    Token<'+'>, Token<'-'>, Token<'*'>, Token<'/'>, Token<'%'>, Token<'^'>>;
+
+struct Op_info
+{
+    size_t prec;
+    bool right_assoc;
+    bool commutative;
+};
+
+namespace meta
+{
+    template <char C>
+    consteval inline Op_info op_info()
+    {
+        if constexpr (requires { Token<C>::commutative; })
+            return { Token<C>::prec, Token<C>::right_assoc, Token<C>::commutative };
+        else if constexpr (requires { Token<C>::prec; })
+            return { Token<C>::prec, Token<C>::right_assoc, false };
+        else return { 0, false, false };
+    };
+
+    template <typename S, char...OO>
+    constexpr inline double apply_op(char op, double a, double b, Type_list<Token<OO>...>)
+    {
+        double r = 0;
+        ((op == OO && (r = double(Token<OO>::expr(S(a), S(b))), true)) || ...);
+        return r;
+    };
+
+    template <size_t...Is>
+    consteval inline auto token_kinds(std::index_sequence<Is...>)
+    { return std::array<Token_vs, sizeof...(Is)>{ Token<char(Is)>::T_t... }; };
+
+    template <size_t...Is>
+    consteval inline auto op_infos(std::index_sequence<Is...>)
+    { return std::array<Op_info, sizeof...(Is)>{ op_info<char(Is)>()... }; };
+}
+
+inline constexpr auto Token_kinds = meta::token_kinds(std::make_index_sequence<256>{});
+inline constexpr auto Op_infos = meta::op_infos(std::make_index_sequence<256>{});
+
+constexpr inline Token_vs token_kind(char c) { return Token_kinds[(unsigned char)c]; }
+constexpr inline Op_info op_info(char c) { return Op_infos[(unsigned char)c]; }
+
+// Evaluates in S, so integral expressions fold with integer division
+template <typename S = double>
+constexpr inline double apply_op(char op, double a, double b)
+{ return meta::apply_op<S>(op, a, b, Operator_table{}); }
+
+// Runs of two or more letters name functions, single characters are variables
+constexpr inline size_t name_length(std::string_view s, size_t pos)
+{
+    size_t n = pos;
+    while (n < s.size() && ((s[n] >= 'a' && s[n] <= 'z') || (s[n] >= 'A' && s[n] <= 'Z'))) ++n;
+    return n - pos;
+}
+
+
+
+// Math library : branch-free polynomials, so loops over them vectorize and
+// constant evaluation needs no libm. precise calls libm at runtime, fast keeps 
+// the polynomials (exp, log and sqrt within 1 ulp of libm, checked in main)
+#include <bit>
+#include <cstdint>
+
+namespace vmath
+{
+    enum class Accuracy
+    {
+        precise,
+        fast
+    };
+
+    template <typename T> struct Bits;
+
+    template <> struct Bits<double>
+    {
+        using U = uint64_t;
+        using I = int64_t;
+        static inline constexpr int mant = 52, bias = 1023, exp_degree = 13;
+        static inline constexpr double round = 0x1.8p52, exp_lo = -746, exp_hi = 710;
+        static inline constexpr double ln2_hi = 6.93147180369123816490e-01, ln2_lo = 1.90821492927058770002e-10;
+        static inline constexpr double denorm_scale = 0x1p54;
+        static inline constexpr int denorm_exp = 54;
+        static inline constexpr uint64_t rsqrt_magic = 0x5FE6EB50C7B537A9;
+        static inline constexpr int rsqrt_steps = 4;
+    };
+
+    template <> struct Bits<float>
+    {
+        using U = uint32_t;
+        using I = int32_t;
+        static inline constexpr int mant = 23, bias = 127, exp_degree = 7;
+        static inline constexpr float round = 0x1.8p23f, exp_lo = -104, exp_hi = 89;
+        static inline constexpr float ln2_hi = 0.693359375f, ln2_lo = -2.12194440e-4f;
+        static inline constexpr float denorm_scale = 0x1p24f;
+        static inline constexpr int denorm_exp = 24;
+        static inline constexpr uint32_t rsqrt_magic = 0x5F375A86;
+        static inline constexpr int rsqrt_steps = 3;
+    };
+
+    template <typename T> concept poly_c = std::same_as<T, float> || std::same_as<T, double>;
+
+    namespace poly
+    {
+        template <poly_c T>
+        constexpr inline T pow2(typename Bits<T>::I k)
+        { return std::bit_cast<T>(typename Bits<T>::U(k + Bits<T>::bias) << Bits<T>::mant); };
+
+        // exp(k ln2 + r) = 2^k exp(r), |r| <= ln2 / 2 and exp(r) by its Taylor series.
+        // 2^k is applied in two halves so results near overflow and in the 
+        // subnormal range round once
+        template <poly_c T>
+        constexpr inline T exp(T x)
+        {
+            using B = Bits<T>;
+            using I = typename B::I;
+
+            constexpr auto c = []
+            {
+                std::array<T, B::exp_degree + 1> c{};
+                double f = 1;
+                for (int n = 0; n <= B::exp_degree; ++n) c[n] = T(1 / f), f *= n + 1;
+                return c;
+            }();
+
+            const T xs = x != x ? T(0) : x < B::exp_lo ? B::exp_lo : x > B::exp_hi ? B::exp_hi : x;
+            const T k = (xs * T(1.44269504088896340736) + B::round) - B::round;
+            const T r = (xs - k * B::ln2_hi) - k * B::ln2_lo;
+
+            T p = c[B::exp_degree];
+            for (int n = B::exp_degree - 1; n >= 0; --n) p = p * r + c[n];
+
+            const I h = I(k) >> 1;
+            const T e = p * pow2<T>(h) * pow2<T>(I(k) - h);
+            return x != x ? x : e;
+        };
+
+        // log(2^e m) = e ln2 + log(m), m in [sqrt(1/2), sqrt(2)), log(m) through
+        // s = f / (2 + f) with the fdlibm minimax coefficients
+        template <poly_c T>
+        constexpr inline T log(T x)
+        {
+            using B = Bits<T>;
+            using U = typename B::U;
+            using I = typename B::I;
+            using lim = std::numeric_limits<T>;
+
+            constexpr T Lg1 = 6.666666666666735130e-01, Lg2 = 3.999999999940941908e-01,
+                        Lg3 = 2.857142874366239149e-01, Lg4 = 2.222219843214978396e-01,
+                        Lg5 = 1.818357216161805012e-01, Lg6 = 1.531383769920937332e-01,
+                        Lg7 = 1.479819860511658591e-01;
+
+            // Inputs are classified on their bits, float compares may trap and
+            // keep the loop from if-converting. Zero, negatives, infinity and 
+            // NaN run through the polynomial as 1
+            constexpr U inf = std::bit_cast<U>(lim::infinity()), one = std::bit_cast<U>(T(1));
+            const U raw = std::bit_cast<U>(x);
+            const bool finite = raw - 1 < inf - 1;
+            const bool tiny = raw < std::bit_cast<U>(lim::min());
+            const U bits = std::bit_cast<U>(std::bit_cast<T>(finite ? raw : one) * (tiny ? B::denorm_scale : T(1)));
+            const U frac = bits & ((U(1) << B::mant) - 1);
+            I e = I(bits >> B::mant) - B::bias - (finite & tiny ? B::denorm_exp : 0);
+
+            constexpr U sqrt2 = std::bit_cast<U>(T(1.41421356237309504880)) & ((U(1) << B::mant) - 1);
+            const bool big = frac > sqrt2;
+            const T m = std::bit_cast<T>(frac | (U(B::bias - big) << B::mant));
+            e += big;
+
+            const T f = m - 1, s = f / (2 + f), z = s * s, w = z * z;
+            const T R = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7))) + w * (Lg2 + w * (Lg4 + w * Lg6));
+            const T hfsq = T(0.5) * f * f;
+            const T k = std::bit_cast<T>(std::bit_cast<U>(B::round) + U(e)) - B::round;  // exact T(e)
+            const T r = k * B::ln2_hi - ((hfsq - (s * (hfsq + R) + k * B::ln2_lo)) - f);
+
+            // r is exactly 0 for the special inputs, adding their result
+            // instead of selecting it keeps r unconditional
+            return r + (finite ? T(0) : raw == inf ? x 
+                 : (raw << 1) == 0 ? -lim::infinity() : lim::quiet_NaN());
+        };
+
+        // 1 / sqrt(x) from the bit-level estimate refined by Newton, then one 
+        // correction of x / sqrt(x). Multiplies only, so it vectorizes where 
+        // std::sqrt needs -fno-math-errno to
+        template <poly_c T>
+        constexpr inline T sqrt(T x)
+        {
+            using B = Bits<T>;
+            using U = typename B::U;
+            using lim = std::numeric_limits<T>;
+
+            constexpr U inf = std::bit_cast<U>(lim::infinity()), one = std::bit_cast<U>(T(1));
+            const U raw = std::bit_cast<U>(x);
+            const bool finite = raw - 1 < inf - 1;
+            const bool tiny = finite & (raw < std::bit_cast<U>(lim::min()));
+            const T xs = std::bit_cast<T>(finite ? raw : one) * (tiny ? B::denorm_scale : T(1));
+
+            T y = std::bit_cast<T>(U(B::rsqrt_magic - (std::bit_cast<U>(xs) >> 1)));
+            for (int i = 0; i < B::rsqrt_steps; ++i) y = y * (T(1.5) - T(0.5) * xs * y * y);
+
+            T r = xs * y;
+            r = (r + T(0.5) * y * (xs - r * r)) * (tiny ? pow2<T>(-B::denorm_exp / 2) : T(1));
+            return finite ? r : raw == inf || (raw << 1) == 0 ? x : lim::quiet_NaN();
+        };
+    }
+
+    // float and double take the dual path, other element types (integers,
+    // simd vectors) defer to their own overloads
+    template <Accuracy A = Accuracy::precise, typename T>
+    constexpr inline auto exp(T x)
+    {
+        if constexpr (poly_c<T>)
+        {
+            if (__builtin_is_constant_evaluated() || A == Accuracy::fast) return poly::exp(x);
+            return std::exp(x);
+        }
+        else { using std::exp; return exp(x); }
+    };
+
+    template <Accuracy A = Accuracy::precise, typename T>
+    constexpr inline auto log(T x)
+    {
+        if constexpr (poly_c<T>)
+        {
+            if (__builtin_is_constant_evaluated() || A == Accuracy::fast) return poly::log(x);
+            return std::log(x);
+        }
+        else { using std::log; return log(x); }
+    };
+
+    template <Accuracy A = Accuracy::precise, typename T>
+    constexpr inline auto sqrt(T x)
+    {
+        if constexpr (poly_c<T>)
+        {
+            if (__builtin_is_constant_evaluated() || A == Accuracy::fast) return poly::sqrt(x);
+            return std::sqrt(x);
+        }
+        else { using std::sqrt; return sqrt(x); }
+    };
+
+    // Floats clear the sign bit, so -0.0 and negative NaNs come out positive as with std::abs
+    template <typename T>
+    constexpr inline T abs(T x)
+    {
+        if constexpr (poly_c<T>)
+        {
+            using U = typename Bits<T>::U;
+            return std::bit_cast<T>(std::bit_cast<U>(x) & ~(U(1) << (sizeof(U) * 8 - 1)));
+        }
+        else if constexpr (std::is_arithmetic_v<T>) return x < 0 ? -x : x;
+        else { using std::abs; return abs(x); }
+    };
+
+    template <typename T>
+    constexpr inline T min(T a, T b)
+    {
+        if constexpr (std::is_arithmetic_v<T>) return b < a ? b : a;
+        else { using std::min; return min(a, b); }
+    };
+
+    template <typename T>
+    constexpr inline T max(T a, T b)
+    {
+        if constexpr (std::is_arithmetic_v<T>) return a < b ? b : a;
+        else { using std::max; return max(a, b); }
+    };
+}
+
+
+
+// Function impl, called by name with one or two comma separated arguments,
+// unary minus is NEG. expr takes the accuracy, grad gives the partials 
+// w.r.t. every argument
+#include <stdexcept>
+
+enum class Fn : char
+{
+    NEG,
+    SQRT,
+    EXP,
+    LOG,
+    ABS,
+    MIN,
+    MAX
+};
+
+template <Fn F> struct Function;
+
+template <> struct Function<Fn::NEG> {
+    static inline constexpr Fn fn = Fn::NEG;
+    static inline constexpr std::string_view name = "neg";
+    static inline constexpr size_t arity = 1;
+    template <vmath::Accuracy A> static inline constexpr auto expr = 
+        [](auto _0) { return -_0; };
+    static inline constexpr auto grad = 
+        [](double) { return std::array{ -1.0 }; };
+};
+
+template <> struct Function<Fn::SQRT> {
+    static inline constexpr Fn fn = Fn::SQRT;
+    static inline constexpr std::string_view name = "sqrt";
+    static inline constexpr size_t arity = 1;
+    template <vmath::Accuracy A> static inline constexpr auto expr = 
+        [](auto _0) { return vmath::sqrt<A>(_0); };
+    static inline constexpr auto grad = 
+        [](double _0) { return std::array{ 0.5 / vmath::sqrt(_0) }; };
+};
+
+template <> struct Function<Fn::EXP> {
+    static inline constexpr Fn fn = Fn::EXP;
+    static inline constexpr std::string_view name = "exp";
+    static inline constexpr size_t arity = 1;
+    template <vmath::Accuracy A> static inline constexpr auto expr = 
+        [](auto _0) { return vmath::exp<A>(_0); };
+    static inline constexpr auto grad = 
+        [](double _0) { return std::array{ vmath::exp(_0) }; };
+};
+
+template <> struct Function<Fn::LOG> {
+    static inline constexpr Fn fn = Fn::LOG;
+    static inline constexpr std::string_view name = "log";
+    static inline constexpr size_t arity = 1;
+    template <vmath::Accuracy A> static inline constexpr auto expr = 
+        [](auto _0) { return vmath::log<A>(_0); };
+    static inline constexpr auto grad = 
+        [](double _0) { return std::array{ 1 / _0 }; };
+};
+
+template <> struct Function<Fn::ABS> {
+    static inline constexpr Fn fn = Fn::ABS;
+    static inline constexpr std::string_view name = "abs";
+    static inline constexpr size_t arity = 1;
+    template <vmath::Accuracy A> static inline constexpr auto expr = 
+        [](auto _0) { return vmath::abs(_0); };
+    static inline constexpr auto grad = 
+        [](double _0) { return std::array{ _0 < 0 ? -1.0 : 1.0 }; };
+};
+
+template <> struct Function<Fn::MIN> {
+    static inline constexpr Fn fn = Fn::MIN;
+    static inline constexpr std::string_view name = "min";
+    static inline constexpr size_t arity = 2;
+    static inline constexpr bool commutative = true;
+    template <vmath::Accuracy A> static inline constexpr auto expr = 
+        [](auto _0, auto _1) { return vmath::min(_0, _1); };
+    static inline constexpr auto grad = 
+        [](double _0, double _1) { return std::array{ _1 < _0 ? 0.0 : 1.0, _1 < _0 ? 1.0 : 0.0 }; };
+};
+
+template <> struct Function<Fn::MAX> {
+    static inline constexpr Fn fn = Fn::MAX;
+    static inline constexpr std::string_view name = "max";
+    static inline constexpr size_t arity = 2;
+    static inline constexpr bool commutative = true;
+    template <vmath::Accuracy A> static inline constexpr auto expr = 
+        [](auto _0, auto _1) { return vmath::max(_0, _1); };
+    static inline constexpr auto grad = 
+        [](double _0, double _1) { return std::array{ _0 < _1 ? 0.0 : 1.0, _0 < _1 ? 1.0 : 0.0 }; };
+};
+
+// In Fn order, so a Function_table index is the Fn value
+template <Fn...FF> struct Function_list {};
+
+using Function_table = Function_list<
+    Fn::NEG, Fn::SQRT, Fn::EXP, Fn::LOG, Fn::ABS, Fn::MIN, Fn::MAX>;
+
+struct Fn_info
+{
+    Fn fn;
+    std::string_view name;
+    size_t arity;
+    bool commutative;
+};
+
+namespace meta
+{
+    template <Fn F>
+    consteval inline Fn_info fn_info()
+    {
+        using Fu = Function<F>;
+        if constexpr (requires { Fu::commutative; }) return { F, Fu::name, Fu::arity, Fu::commutative };
+        else return { F, Fu::name, Fu::arity, false };
+    };
+
+    template <Fn...FF>
+    consteval inline auto fn_infos(Function_list<FF...>)
+    {
+        constexpr Fn order[] = { FF... };
+        for (size_t i = 0; i < sizeof...(FF); ++i)
+            if (size_t(order[i]) != i) throw std::logic_error("Function_table out of Fn order");
+        return std::array<Fn_info, sizeof...(FF)>{ fn_info<FF>()... };
+    };
+
+    template <Fn...FF>
+    constexpr inline double apply_fn(Fn f, double a, double b, Function_list<FF...>)
+    {
+        double r = 0;
+        ((f == FF && (r = [&]
+        {
+            if constexpr (Function<FF>::arity == 1) return Function<FF>::template expr<vmath::Accuracy::precise>(a);
+            else return Function<FF>::template expr<vmath::Accuracy::precise>(a, b);
+        }(), true)) || ...);
+        return r;
+    };
+}
+
+inline constexpr auto Fn_infos = meta::fn_infos(Function_table{});
+
+constexpr inline const Fn_info& fn_info(Fn f) { return Fn_infos[size_t(f)]; }
+constexpr inline const Fn_info& fn_info(char f) { return fn_info(Fn(f)); }
+
+constexpr inline const Fn_info& fn_info(std::string_view name)
+{
+    for (const Fn_info& f : Fn_infos)
+        if (f.name == name) return f;
+    throw std::invalid_argument("unknown function");
+}
+
+constexpr inline double apply_fn(Fn f, double a, double b = 0)
+{ return meta::apply_fn(f, a, b, Function_table{}); }
+
+
+
 // String interning : AlexPolt (http://alexpolt.github.io/intern.html)
 #define N3599
 namespace intern
@@ -259,8 +755,6 @@ struct Lex_dict
         decltype(meta::tl_flip<meta::Type_list<>>(Is{}))>;
 };
 
-using Empty_lex = Lex_dict<meta::Type_list<>, meta::Type_list<>, meta::Type_list<>>;
-
 template <typename> struct is_lxdc : std::false_type {};
 template <tokls_c Vs, tokls_c Os, idxls_c Is> 
 struct is_lxdc <Lex_dict<Vs, Os, Is>> : std::true_type {};
@@ -271,203 +765,1492 @@ template <typename Ty> concept lxdc_c = is_lxdc<Ty>::value;
 
 
 
-// Lexer append impl
-namespace meta 
-{
-    template <lxdc_c, char, size_t> struct Lex_append;
+// Lexer, scans into arrays and converts to types once at the end
+#include <string_view>
 
-    template <lxdc_c Lex, char C> struct Lex_append <Lex, C, Token_vs::VARIABLE>
+class Tokenize
+{
+    template <size_t N>
+    struct Scan
     {
-        static inline constexpr bool do_append 
-            = not (Lex::Vars::template exists<Token<C>>());
+        char vars[N];
+        char ops[N];
+        size_t idxs[N];
+        size_t var_count;
+        size_t op_count;
+        size_t idx_count;
+    };
 
-        static inline constexpr size_t idx_v = 
-            (do_append) ? Lex::Vars::count() : 
-            Lex::Vars::template locate<Token<C>>();
+    // Expressions scanned together share one variable dictionary
+    template <size_t N, size_t...MM>
+    static consteval auto scan(const char (&...src)[MM])
+    {
+        Scan<N> s{};
+        for (const std::string_view e : { std::string_view(src, MM)... })
+        for (size_t p = 0; p < e.size(); ++p)
+        {
+            const char c = e[p];
+            switch (token_kind(c))
+            {
+            case Token_vs::VARIABLE:
+            {
+                if (const size_t n = name_length(e, p); n > 1) { p += n - 1; break; }
+
+                size_t i = 0;
+                while (i < s.var_count && s.vars[i] != c) ++i;
+                if (i == s.var_count) s.vars[s.var_count++] = c;
+                s.idxs[s.idx_count++] = i;
+                break;
+            }
+            case Token_vs::OPERATOR:
+                s.ops[s.op_count++] = c;
+                break;
+            default:
+                break;
+            }
+        }
+        return s;
+    };
 
-        using type = Lex_dict<
-            typename Lex::Vars::template append_if<do_append, Token<C>>::type,
-            typename Lex::Ops, 
-            typename Lex::Idxs::template append<Size_t<idx_v>>::type
-        >;
+    template <auto S, size_t...Vs, size_t...Os, size_t...Is>
+    static consteval auto to_types(
+        std::index_sequence<Vs...>, std::index_sequence<Os...>, std::index_sequence<Is...>)
+    {
+        return Lex_dict<
+            meta::Type_list<Token<S.vars[Vs]>...>,
+            meta::Type_list<Token<S.ops[Os]>...>,
+            meta::Type_list<Size_t<S.idxs[Is]>...>>{};
     };
 
-    template <lxdc_c Lex, char C> struct Lex_append <Lex, C, Token_vs::OPERATOR>
+public:
+    template <string_c...Exprs>
+    static consteval auto gen_tokens()
     {
-        using type = Lex_dict<
-            typename Lex::Vars, 
-            typename Lex::Ops::template append<Token<C>>::type, 
-            typename Lex::Idxs
-        >;
+        constexpr auto s = scan<(sizeof(Exprs::value) + ...)>(Exprs::value...);
+        return to_types<s>(
+            std::make_index_sequence<s.var_count>{},
+            std::make_index_sequence<s.op_count>{},
+            std::make_index_sequence<s.idx_count>{});
     };
+};
 
-    template <lxdc_c Lex, char C> struct Lex_append <Lex, C, Token_vs::WHITESPACE>
-    { using type = Lex; };
 
-    template <lxdc_c Lex, char C> struct Lex_append <Lex, C, Token_vs::ENDOF>
-    { using type = Lex; };
 
-}
+// Expression AST, nodes are stored in post-order so children precede parents
+#include <vector>
 
-template <lxdc_c, typename> struct Lex_append;
-template <lxdc_c Lex, char C> struct Lex_append <Lex, Token<C>>
+namespace ast
 {
-    using type = typename meta::Lex_append<Lex, C, Token<C>::T_t>::type; 
-};
+    enum Node_kind : size_t
+    {
+        CONST,
+        VAR,
+        BINARY,
+        CALL
+    };
 
-class Tokenize
-{
-    template <lxdc_c Lex>
-    static inline consteval auto 
-        gen_tokens_impl(meta::Type_list<>)
+    struct Node
     {
-        return Lex{};
+        Node_kind kind;
+        char op;     // Fn for CALL
+        size_t lhs;  // variable index for VAR
+        size_t rhs;  // unused by unary CALLs
+        double value = 0;
     };
 
-    template <lxdc_c Lex, char C, char...CC>
-    static inline consteval auto 
-        gen_tokens_impl(meta::Type_list<Token<C>, Token<CC>...>)
+    // Number of child slots, held in lhs then rhs
+    constexpr inline size_t operands(const Node& n)
     {
-        return gen_tokens_impl
-            <typename Lex_append<Lex, Token<C>>::type>
-            (meta::Type_list<Token<CC>...>{});
+        switch (n.kind)
+        {
+        case BINARY: return 2;
+        case CALL: return fn_info(n.op).arity;
+        default: return 0;
+        }
     };
 
-public:
-    template <string_c Expr>
-    static consteval auto gen_tokens()
+    template <size_t N>
+    struct Ast
     {
-        return gen_tokens_impl<Empty_lex>(typename Expr::tokens{});
+        Node nodes[N];
+        size_t size;
+
+        constexpr size_t push(Node n) { nodes[size] = n; return size++; };
+        constexpr size_t root() const { return size - 1; };
     };
-};
 
+    // Growable counterpart for transient constexpr and runtime use
+    struct Node_list
+    {
+        std::vector<Node> nodes;
+        size_t size = 0;
+
+        constexpr size_t push(Node n) { nodes.push_back(n); return size++; };
+        constexpr size_t root() const { return size - 1; };
+    };
+}
 
 
-// Pointer attributes
-namespace meta
+
+// Parser : precedence climbing over the Token table
+#include <stdexcept>
+#include <string_view>
+
+template <typename Nodes>
+class Parser
 {
-    template <typename> struct Pointer_attributes {};
+    std::string_view d_src;
+    std::string_view d_vars;
+    size_t d_pos = 0;
+    Nodes& d_out;
 
-    template <typename R, typename...Args>
-    struct Pointer_attributes <R(*)(Args...)>
+    constexpr char peek()
     {
-        using Ret_t = R;
-        using Arg_t = Type_list<Args...>;
-        static constexpr inline size_t count = sizeof...(Args);
+        while (d_pos < d_src.size() && token_kind(d_src[d_pos]) == Token_vs::WHITESPACE)
+            ++d_pos;
+        return d_pos < d_src.size() ? d_src[d_pos] : '\0';
     };
 
-    template <typename R, class C, typename...Args>
-    struct Pointer_attributes <R(C::*)(Args...) const>
+    constexpr double number(char c)
     {
-        using Ret_t = R;
-        using Class_t = C;
-        using Arg_t = Type_list<Args...>;
-        static constexpr inline size_t count = sizeof...(Args);
+        double v = 0, scale = 1;
+        bool frac = false;
+        for (;;)
+        {
+            if (c != '.') v = v * 10 + (c - '0'), scale *= frac ? 10 : 1;
+            else if (frac) throw std::invalid_argument("malformed constant");
+            else frac = true;
+
+            if (d_pos == d_src.size() || token_kind(d_src[d_pos]) != Token_vs::CONSTANT)
+                return v / scale;
+            c = d_src[d_pos++];
+        }
     };
-}
 
-template <auto Lam>
-struct Lambda_wrapper 
-    : meta::Pointer_attributes<decltype(&decltype(Lam)::operator ())>
-{
-    static constexpr inline auto function = Lam;
+    constexpr size_t primary()
+    {
+        const char c = peek();
+        ++d_pos;
+
+        switch (token_kind(c))
+        {
+        case Token_vs::OPEN:
+        {
+            const size_t e = expression(1);
+            if (token_kind(peek()) != Token_vs::CLOSE)
+                throw std::invalid_argument("expected ')'");
+            ++d_pos;
+            return e;
+        }
+        case Token_vs::VARIABLE:
+        {
+            if (const size_t n = name_length(d_src, d_pos - 1); n > 1)
+                return call(d_src.substr(d_pos - 1, n));
+
+            const size_t idx = d_vars.find(c);
+            if (idx == std::string_view::npos)
+                throw std::invalid_argument("variable missing from dictionary");
+            return d_out.push({ ast::VAR, c, idx, 0 });
+        }
+        case Token_vs::CONSTANT:
+            return d_out.push({ ast::CONST, '\0', 0, 0, number(c) });  // equal values share a slot
+        case Token_vs::OPERATOR:
+        {
+            // Unary minus binds tighter than everything but '^', -a ^ 2 is -(a ^ 2)
+            if (c != '-') throw std::invalid_argument("expected operand");
+            const size_t e = expression(Token<'^'>::prec);
+            return d_out.push({ ast::CALL, char(Fn::NEG), e, 0 });
+        }
+        default:
+            throw std::invalid_argument("expected operand");
+        }
+    };
+
+    constexpr size_t call(std::string_view name)
+    {
+        const Fn_info& f = fn_info(name);
+        d_pos += name.size() - 1;
+        if (token_kind(peek()) != Token_vs::OPEN)
+            throw std::invalid_argument("expected '(' after function name");
+        ++d_pos;
+
+        size_t args[2] = {};
+        for (size_t i = 0; i < f.arity; ++i)
+        {
+            if (i > 0 && token_kind(peek()) != Token_vs::SEPARATOR)
+                throw std::invalid_argument("expected ','");
+            if (i > 0) ++d_pos;
+            args[i] = expression(1);
+        }
+
+        if (token_kind(peek()) != Token_vs::CLOSE)
+            throw std::invalid_argument("expected ')'");
+        ++d_pos;
+        return d_out.push({ ast::CALL, char(f.fn), args[0], args[1] });
+    };
+
+    constexpr size_t expression(size_t min_prec)
+    {
+        size_t lhs = primary();
+        for (char c = peek();
+            token_kind(c) == Token_vs::OPERATOR && op_info(c).prec >= min_prec;
+            c = peek())
+        {
+            ++d_pos;
+            const Op_info info = op_info(c);
+            const size_t rhs = expression(info.right_assoc ? info.prec : info.prec + 1);
+            lhs = d_out.push({ ast::BINARY, c, lhs, rhs });
+        }
+        return lhs;
+    };
+
+public:
+    constexpr Parser(std::string_view src, std::string_view vars, Nodes& out)
+        : d_src(src), d_vars(vars), d_out(out) {};
+
+    constexpr size_t run()
+    {
+        const size_t root = expression(1);
+        if (peek() != '\0') throw std::invalid_argument("unexpected token");
+        return root;
+    };
 };
 
-template <auto...Lams>
-struct Lambda_list
+template <string_c Expr, char...VV, typename Os, typename Is>
+consteval inline auto parse(Lex_dict<meta::Type_list<Token<VV>...>, Os, Is>)
 {
-    using value = meta::Type_list<Lambda_wrapper<Lams>...>;
-    static constexpr inline size_t count = sizeof...(Lams);
-    static constexpr inline size_t arg_count = (Lambda_wrapper<Lams>::count + ...) - 1;
+    constexpr char vars[] = { VV..., '\0' };
+    ast::Ast<sizeof(Expr::value)> a{};
+    Parser{ Expr::value, { vars, sizeof...(VV) }, a }.run();
+    return a;
 };
 
 
 
-#include <tuple>
+// Optimizer : constant folding, strength reduction and common subexpressions
+#include <bit>
+#include <span>
 
-// Lambda constructor
-namespace meta
+struct Optimize
 {
-    template <auto, typename Input>
-    struct Unpack_as
-    { using type = Input; };
+    bool reciprocal_div = false;  // x / c -> x * (1 / c), may change rounding
+    long max_pow = 16;            // x ^ n with |n| <= max_pow (at most 64) becomes multiplies
+    vmath::Accuracy math = vmath::Accuracy::precise;  // fast inlines exp and log, within 1 ulp
+};
+
+// S is the scalar type the expression runs in, constants fold in it
+template <typename S, typename Src, typename Dst>
+class Optimizer
+{
+    static inline constexpr size_t npos = std::numeric_limits<size_t>::max();
+    static inline constexpr long pow_limit = 64;  // caps Optimize::max_pow
+
+    const Src& d_src;
+    Dst& d_out;
+    Optimize d_opt;
+    std::vector<size_t> d_memo;
+
+    static constexpr ast::Node constant(double v) { return { ast::CONST, '\0', 0, 0, v }; };
 
-    template <auto L, size_t _1, size_t _2>
-    struct Final
+    static constexpr bool same(const ast::Node& a, const ast::Node& b)
     {
-        template <typename...TT>
-        constexpr static inline auto call(std::tuple<TT...>& t)
-        {
-            return L(std::get<_1>(t), std::get<_2>(t));
-        };
+        return a.kind == b.kind && a.op == b.op && a.lhs == b.lhs && a.rhs == b.rhs
+            && std::bit_cast<unsigned long long>(a.value) == std::bit_cast<unsigned long long>(b.value);
     };
 
-    template <typename, typename> struct Expand;
+    // Hash-consing, equal subtrees share one slot
+    constexpr size_t intern(ast::Node n)
+    {
+        const bool commutative = n.kind == ast::BINARY ? op_info(n.op).commutative 
+            : n.kind == ast::CALL && fn_info(n.op).commutative;
+        if (commutative && n.lhs > n.rhs)
+            std::swap(n.lhs, n.rhs);
+        for (size_t i = 0; i < d_out.size; ++i)
+            if (same(d_out.nodes[i], n)) return i;
+        return d_out.push(n);
+    };
 
-    template <auto L, auto...LL, size_t N, size_t...NN>
-    struct Expand <Lambda_list<L, LL...>, Type_list<Size_t<N>, Size_t<NN>...>>
+    constexpr size_t power(size_t x, long n)
     {
-        template <typename...TT>
-        constexpr static inline auto call(std::tuple<TT...>& t)
-        {
-            if constexpr(sizeof...(NN) == 1) return Final<L, NN..., N>::call(t);
-            else return L(
-                Expand<Lambda_list<LL...>, 
-                Type_list<Size_t<NN>...>>::call(t), 
-                std::get<N>(t)
-            );
-        };
+        if (n < 0) return intern({ ast::BINARY, '/', intern(constant(1.0)), power(x, -n) });
+        if (n == 0) return intern(constant(1.0));
+        if (n == 1) return x;
+
+        const size_t h = power(x, n / 2);
+        const size_t sq = intern({ ast::BINARY, '*', h, h });
+        return (n % 2) ? intern({ ast::BINARY, '*', sq, x }) : sq;
     };
-}
 
-template <char...VV, char...OO, size_t...NN>
-consteval inline auto 
-get_as_lambda(
-    Lex_dict<
-        meta::Type_list<Token<VV>...>, 
-        meta::Type_list<Token<OO>...>,
-        meta::Type_list<Size_t<NN>...>>)
-{
-    using lambda_pack = Lambda_list<Token<OO>::expr...>;
-    using index_pack = meta::Type_list<Size_t<NN>...>;
-    using tuple_in = std::tuple<typename meta::Unpack_as<VV, double>::type&&...>;
+    // Integer division by zero is left for run time rather than failing the build
+    static constexpr bool foldable(char op, double a, double b)
+    {
+        if constexpr (std::is_integral_v<S>)
+            return not ((op == '/' || op == '%') && S(b) == 0)
+                && not (op == '^' && S(a) == 0 && S(b) < 0);
+        else return true;
+    };
 
-    return [] (tuple_in t) constexpr
+    static constexpr bool negation(const ast::Node& n)
+    { return n.kind == ast::CALL && Fn(n.op) == Fn::NEG; };
+
+    constexpr size_t simplify_call(ast::Node n)
     {
-        return meta::Expand<lambda_pack, index_pack>::call(t);
+        const ast::Node a = d_out.nodes[n.lhs];
+        const size_t arity = fn_info(n.op).arity;
+        if (a.kind == ast::CONST && (arity == 1 || d_out.nodes[n.rhs].kind == ast::CONST))
+            return intern(constant(apply_fn(Fn(n.op), a.value, 
+                arity == 1 ? 0.0 : d_out.nodes[n.rhs].value)));
+
+        if (arity == 1) n.rhs = 0;
+        if (negation(n) && negation(a)) return a.lhs;
+        return intern(n);
     };
-};
 
+    constexpr size_t simplify(ast::Node n)
+    {
+        if (n.kind == ast::CALL) return simplify_call(n);
+        if (n.kind != ast::BINARY) return intern(n);
 
-// Expression builder
-#include <string_view>
+        const ast::Node a = d_out.nodes[n.lhs], b = d_out.nodes[n.rhs];
+        if (a.kind == ast::CONST && b.kind == ast::CONST && foldable(n.op, a.value, b.value))
+            return intern(constant(apply_op<S>(n.op, a.value, b.value)));
 
-template <const_string S, string_c Expr = decltype(make_str_t<S>())> 
-struct Eval
-{
-protected: static inline constexpr std::string_view s_name = Expr::value;
-public:
-    template <typename...TT>
-    constexpr double operator()(TT&&...tt) const
+        // x + -y -> x - y, x - -y -> x + y
+        if ((n.op == '+' || n.op == '-') && negation(b))
+            return intern({ ast::BINARY, n.op == '+' ? '-' : '+', n.lhs, b.lhs });
+
+        // Range first, the cast is only defined for values that fit in long
+        const double limit = double(std::min(d_opt.max_pow, pow_limit));
+        if (b.kind == ast::CONST && n.op == '^' && -limit <= b.value && b.value <= limit
+            && b.value == (long)b.value)
+            return power(n.lhs, (long)b.value);
+
+        if (b.kind == ast::CONST && n.op == '/' && d_opt.reciprocal_div && b.value != 0
+            && not std::is_integral_v<S>)
+            return intern({ ast::BINARY, '*', n.lhs, intern(constant(1.0 / b.value)) });
+
+        return intern(n);
+    };
+
+    constexpr size_t rewrite(size_t i)
     {
-        using flipped = typename decltype(Tokenize::gen_tokens<Expr>())::flip;
-        constexpr auto e = get_as_lambda(flipped{});
-        return e(std::make_tuple<TT&&...>(static_cast<TT&&>(tt)...));
+        if (d_memo[i] != npos) return d_memo[i];
+
+        ast::Node n = d_src.nodes[i];
+        if (ast::operands(n) > 0) n.lhs = rewrite(n.lhs);
+        if (ast::operands(n) > 1) n.rhs = rewrite(n.rhs);
+        return d_memo[i] = simplify(n);
     };
 
-    std::string_view name() const { return Eval<S, Expr>::s_name; }
-};
+public:
+    constexpr Optimizer(const Src& src, Dst& out, Optimize opt)
+        : d_src(src), d_out(out), d_opt(opt), d_memo(src.size, npos) {};
 
-#include <iostream>
+    constexpr size_t run() { return rewrite(d_src.root()); };
+};
 
-int main()
+namespace ast
 {
-    constexpr double d = Eval<"a - b * c / d">{}(1.0, 2.0, 7.0, 3.9);
-    std::cout << d << std::endl;
+    // Drops nodes left unreachable by the rewrites and remaps the roots,
+    // a single root stays last
+    template <typename Src, typename Dst>
+    constexpr inline void compact(const Src& src, std::span<size_t> roots, Dst& out)
+    {
+        std::vector<bool> live(src.size, false);
+        std::vector<size_t> slot(src.size, 0);
+        for (const size_t root : roots) live[root] = true;
+        for (size_t i = src.size; i-- > 0;)
+        {
+            if (not live[i]) continue;
+            if (operands(src.nodes[i]) > 0) live[src.nodes[i].lhs] = true;
+            if (operands(src.nodes[i]) > 1) live[src.nodes[i].rhs] = true;
+        }
 
-    auto e = Eval<"g ^ b">{};
-    std::cout << e(3.1, 4.7) << std::endl;
+        for (size_t i = 0; i < src.size; ++i)
+        {
+            if (not live[i]) continue;
+            Node n = src.nodes[i];
+            if (operands(n) > 0) n.lhs = slot[n.lhs];
+            if (operands(n) > 1) n.rhs = slot[n.rhs];
+            slot[i] = out.push(n);
+        }
+        for (size_t& root : roots) root = slot[root];
+    };
+
+    // Sources optimized into one list share their common subexpressions
+    template <typename S = double, typename...Srcs>
+    constexpr inline Node_list optimize(Optimize opt, std::span<size_t> roots, const Srcs&...srcs)
+    {
+        Node_list work, out;
+        size_t k = 0;
+        ((roots[k++] = Optimizer<S, Srcs, Node_list>{ srcs, work, opt }.run()), ...);
+        compact(work, roots, out);
+        return out;
+    };
+
+    template <typename S = double, typename Src>
+    constexpr inline Node_list optimize(const Src& src, Optimize opt)
+    {
+        size_t root = 0;
+        return optimize<S>(opt, { &root, 1 }, src);
+    };
+
+    template <size_t N, size_t K>
+    struct Forest
+    {
+        Ast<N> ast;
+        size_t roots[K];
+    };
+}
+
+template <auto A, Optimize O, typename S = double>
+consteval inline auto optimize()
+{
+    const ast::Node_list list = ast::optimize<S>(A, O);
+    ast::Ast<ast::optimize<S>(A, O).size> out{};
+    for (const ast::Node& n : list.nodes) out.push(n);
+    return out;
+};
+
+template <Optimize O, typename S, auto...As>
+consteval inline auto optimize_set()
+{
+    constexpr size_t K = sizeof...(As);
+    constexpr size_t N = [] { size_t r[K]; return ast::optimize<S>(O, r, As...).size; }();
+
+    ast::Forest<N, K> out{};
+    const ast::Node_list list = ast::optimize<S>(O, out.roots, As...);
+    for (const ast::Node& n : list.nodes) out.ast.push(n);
+    return out;
+};
+
+
+
+// Typed nodes, each one reads its operands from the slots of earlier nodes
+#include <algorithm>
+#include <cstdint>
+#include <tuple>
+
+namespace ast
+{
+    // Scalar type of a vector element type, e.g. float for simd<float>
+    template <typename Ty> struct Scalar { using type = Ty; };
+    template <typename Ty> requires requires { typename Ty::value_type; }
+    struct Scalar<Ty> { using type = typename Ty::value_type; };
+
+    // forward() fills the tangent of slot Self from earlier tangents,
+    // reverse() pushes the adjoint of slot Self to its operands
+    template <double V> struct Const
+    {
+        template <typename Regs, typename Tuple>
+        constexpr static inline auto call(const Regs&, const Tuple&)
+        {
+            using T = typename Regs::value_type;
+            return T(static_cast<typename Scalar<T>::type>(V));
+        };
+
+        template <size_t Self, typename Regs, typename Tan>
+        constexpr static inline void forward(const Regs&, Tan&) {};
+
+        template <size_t Self, typename Regs, typename Adj, typename Grad>
+        constexpr static inline void reverse(const Regs&, Adj&, Grad&) {};
+
+        template <typename Masks>
+        constexpr static inline uint64_t depends(const Masks&) { return 0; };
+    };
+
+    template <size_t I> struct Var
+    {
+        template <typename Regs, typename Tuple>
+        constexpr static inline auto call(const Regs&, const Tuple& t)
+        { return std::get<I>(t); };
+
+        template <size_t Self, typename Regs, typename Tan>
+        constexpr static inline void forward(const Regs&, Tan& dr)
+        { dr[Self][I] = 1.0; };
+
+        template <size_t Self, typename Regs, typename Adj, typename Grad>
+        constexpr static inline void reverse(const Regs&, Adj& adj, Grad& g)
+        { g[I] += adj[Self]; };
+
+        template <typename Masks>
+        constexpr static inline uint64_t depends(const Masks&)
+        {
+            static_assert(I < 64, "dependency masks hold 64 variables");
+            return uint64_t(1) << I;
+        };
+    };
+
+    template <char Op, size_t L, size_t R> struct Binary
+    {
+        template <typename Regs, typename Tuple>
+        constexpr static inline auto call(const Regs& r, const Tuple&)
+        { return Token<Op>::expr(r[L], r[R]); };
+
+        template <size_t Self, typename Regs, typename Tan>
+        constexpr static inline void forward(const Regs& r, Tan& dr)
+        {
+            const auto [dl, dg] = Token<Op>::grad(r[L], r[R]);
+            for (size_t v = 0; v < dr[Self].size(); ++v) 
+                dr[Self][v] = dl * dr[L][v] + dg * dr[R][v];
+        };
+
+        template <size_t Self, typename Regs, typename Adj, typename Grad>
+        constexpr static inline void reverse(const Regs& r, Adj& adj, Grad&)
+        {
+            const auto [dl, dg] = Token<Op>::grad(r[L], r[R]);
+            adj[L] += dl * adj[Self];
+            adj[R] += dg * adj[Self];
+        };
+
+        template <typename Masks>
+        constexpr static inline uint64_t depends(const Masks& m) { return m[L] | m[R]; };
+    };
+
+    template <Fn F, vmath::Accuracy A, size_t...Args> struct Call
+    {
+        static inline constexpr size_t args[] = { Args... };
+
+        template <typename Regs, typename Tuple>
+        constexpr static inline auto call(const Regs& r, const Tuple&)
+        { return Function<F>::template expr<A>(r[Args]...); };
+
+        template <size_t Self, typename Regs, typename Tan>
+        constexpr static inline void forward(const Regs& r, Tan& dr)
+        {
+            const auto d = Function<F>::grad(r[Args]...);
+            for (size_t v = 0; v < dr[Self].size(); ++v)
+            {
+                dr[Self][v] = 0;
+                for (size_t k = 0; k < d.size(); ++k) dr[Self][v] += d[k] * dr[args[k]][v];
+            }
+        };
+
+        template <size_t Self, typename Regs, typename Adj, typename Grad>
+        constexpr static inline void reverse(const Regs& r, Adj& adj, Grad&)
+        {
+            const auto d = Function<F>::grad(r[Args]...);
+            for (size_t k = 0; k < d.size(); ++k) adj[args[k]] += d[k] * adj[Self];
+        };
+
+        template <typename Masks>
+        constexpr static inline uint64_t depends(const Masks& m) { return (m[Args] | ...); };
+    };
+
+    enum class Ad_mode
+    {
+        automatic,  // forward for few variables, reverse otherwise
+        forward,
+        reverse
+    };
+
+    template <size_t V>
+    struct Gradient
+    {
+        double value;
+        std::array<double, V> partials;
+    };
+
+    template <typename...NN> struct Tree
+    {
+        static inline constexpr size_t size = sizeof...(NN);
+
+        template <typename T, typename Tuple>
+        constexpr static inline auto run(const Tuple& t)
+        {
+            std::array<T, size> r{};
+            [&]<size_t...Is>(std::index_sequence<Is...>)
+            { ((r[Is] = NN::call(r, t)), ...); }
+            (std::index_sequence_for<NN...>{});
+            return r;
+        };
+
+        template <typename T, typename Tuple>
+        constexpr static inline T call(const Tuple& t)
+        { return run<T>(t).back(); };
+
+        // Bit I of depends[n] is set when slot n reads variable I
+        static inline constexpr auto depends = []
+        {
+            std::array<uint64_t, size> m{};
+            size_t n = 0;
+            ((m[n] = NN::depends(m), ++n), ...);
+            return m;
+        }();
+
+        // Recomputes in place only the slots that read variable I
+        template <size_t I, typename Regs, typename Tuple>
+        constexpr static inline void rerun(Regs& r, const Tuple& t)
+        {
+            [&]<size_t...Is>(std::index_sequence<Is...>)
+            {
+                ([&] { if constexpr (depends[Is] >> I & 1) r[Is] = NN::call(r, t); }(), ...);
+            }
+            (std::index_sequence_for<NN...>{});
+        };
+
+        // Value and all partials in one pass, O(size * V) forward, O(size) reverse
+        template <Ad_mode M, size_t V>
+        constexpr static inline Gradient<V> gradient(const std::array<double, V>& t)
+        {
+            const auto r = run<double>(t);
+            Gradient<V> g{ r.back(), {} };
+
+            if constexpr (M == Ad_mode::forward || (M == Ad_mode::automatic && V <= 4))
+            {
+                std::array<std::array<double, V>, size> dr{};
+                [&]<size_t...Is>(std::index_sequence<Is...>)
+                { (NN::template forward<Is>(r, dr), ...); }
+                (std::index_sequence_for<NN...>{});
+                g.partials = dr.back();
+            }
+            else
+            {
+                using nodes = meta::Type_list<NN...>;
+                std::array<double, size> adj{};
+                adj.back() = 1.0;
+                [&]<size_t...Is>(std::index_sequence<Is...>)
+                {
+                    (decltype(nodes::template get<size - 1 - Is>())::type
+                        ::template reverse<size - 1 - Is>(r, adj, g.partials), ...);
+                }
+                (std::index_sequence_for<NN...>{});
+            }
+            return g;
+        };
+    };
+
+    // Keeps the slots of the last evaluation, so that changing one variable
+    // costs only the nodes on its paths to the root
+    template <typename Tree, typename T, char...VV>
+    class Incremental
+    {
+        static inline constexpr size_t V = sizeof...(VV);
+
+        std::array<T, V> d_vars;
+        std::array<T, Tree::size> d_regs;
+
+        template <size_t I>
+        constexpr void assign(T value)
+        {
+            d_vars[I] = value;
+            Tree::template rerun<I>(d_regs, d_vars);
+        };
+
+    public:
+        constexpr explicit Incremental(const std::array<T, V>& vars)
+            : d_vars(vars), d_regs(Tree::template run<T>(vars)) {};
+
+        constexpr T value() const { return d_regs.back(); };
+        constexpr const std::array<T, V>& vars() const { return d_vars; };
+
+        template <char C>
+        constexpr T update(T value)
+        {
+            constexpr char vars[] = { VV... };
+            constexpr size_t i = std::find(vars, vars + V, C) - vars;
+            static_assert(i < V, "variable missing from dictionary");
+            assign<i>(value);
+            return d_regs.back();
+        };
+
+        constexpr T update(char c, T value)
+        {
+            constexpr char vars[] = { VV... };
+            const size_t i = std::find(vars, vars + V, c) - vars;
+            if (i == V) throw std::invalid_argument("variable missing from dictionary");
+
+            [&]<size_t...Is>(std::index_sequence<Is...>)
+            { ((i == Is ? assign<Is>(value) : void()), ...); }
+            (std::make_index_sequence<V>{});
+            return d_regs.back();
+        };
+    };
+
+    template <Node N, vmath::Accuracy M>
+    consteval inline auto lower_node()
+    {
+        if constexpr (N.kind == CONST) return meta::Type_wrapper<Const<N.value>>{};
+        else if constexpr (N.kind == VAR) return meta::Type_wrapper<Var<N.lhs>>{};
+        else if constexpr (N.kind == BINARY) return meta::Type_wrapper<Binary<N.op, N.lhs, N.rhs>>{};
+        else if constexpr (operands(N) == 1) return meta::Type_wrapper<Call<Fn(N.op), M, N.lhs>>{};
+        else return meta::Type_wrapper<Call<Fn(N.op), M, N.lhs, N.rhs>>{};
+    };
+}
+
+template <auto A, vmath::Accuracy M, size_t...Is>
+consteval inline auto lower(std::index_sequence<Is...>)
+{
+    return meta::Type_wrapper<ast::Tree<
+        typename decltype(ast::lower_node<A.nodes[Is], M>())::type...>>{};
+};
+
+
+
+// Lambda constructor
+namespace meta
+{
+    template <auto, typename Input>
+    struct Unpack_as
+    { using type = Input; };
+}
+
+// Without Roots the lambda returns the last slot, otherwise an array of the given slots
+template <typename Tree, typename T, size_t...Roots, char...VV, typename Os, typename Is>
+consteval inline auto
+get_as_lambda(Lex_dict<meta::Type_list<Token<VV>...>, Os, Is>)
+{
+    using tuple_in = std::tuple<typename meta::Unpack_as<VV, T>::type...>;
+
+    return [] (tuple_in t) constexpr
+    {
+        if constexpr (sizeof...(Roots) == 0) return Tree::template call<T>(t);
+        else
+        {
+            const auto r = Tree::template run<T>(t);
+            return std::array<T, sizeof...(Roots)>{ r[Roots]... };
+        }
+    };
+};
+
+
+template <typename Tree, typename T, char...VV, typename Os, typename Is>
+constexpr inline auto make_incremental(
+    Lex_dict<meta::Type_list<Token<VV>...>, Os, Is>, 
+    const std::array<T, sizeof...(VV)>& vars)
+{
+    return ast::Incremental<Tree, T, VV...>(vars);
+};
+
+
+// Batch kernel
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <span>
+
+// Register width in bytes, override with -DEVAL_SIMD_WIDTH=N
+#ifndef EVAL_SIMD_WIDTH
+#   if defined(__AVX512F__)
+#       define EVAL_SIMD_WIDTH 64
+#   elif defined(__AVX__)
+#       define EVAL_SIMD_WIDTH 32
+#   else
+#       define EVAL_SIMD_WIDTH 16
+#   endif
+#endif
+
+// Rows ahead of the current block touched by prefetches on strided inputs
+#ifndef EVAL_PREFETCH_ROWS
+#   define EVAL_PREFETCH_ROWS 16
+#endif
+
+// Input column addressed by byte offset and stride, e.g. one field of packed records.
+// Loads go through memcpy, the field may be misaligned and is not a T object
+// as far as aliasing is concerned; compilers turn it into a plain load
+#include <cstring>
+
+template <typename T>
+struct Strided
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    const std::byte* base;
+    size_t stride;
+
+    T operator[](size_t l) const 
+    {
+        T v;
+        std::memcpy(&v, base + l * stride, sizeof(T));
+        return v;
+    };
+
+    void prefetch(size_t l) const { __builtin_prefetch(base + l * stride); };
+};
+
+// Binds the expression variable V to the record member M
+template <char V, auto M> struct Bind 
+{
+    static inline constexpr char var = V;
+    static inline constexpr auto member = M;
+};
+
+namespace meta
+{
+    template <typename Ty>
+    static inline constexpr size_t Lanes = std::max<size_t>(1, EVAL_SIMD_WIDTH / sizeof(Ty));
+
+    template <size_t K, typename Ty>
+    constexpr inline auto lane_at(const Ty& v)
+    {
+        if constexpr (requires { std::tuple_size<Ty>::value; }) return v[K];
+        else return v;
+    };
+
+    template <auto M, typename Rec>
+    struct Member
+    {
+        const Rec* rec;
+
+        const auto& operator[](size_t l) const { return rec[l].*M; };
+        void prefetch(size_t l) const { __builtin_prefetch(rec + l); };
+    };
+
+    // Full lanes run as one omp simd block each, the remainder as a scalar tail.
+    // Inputs are anything indexable by row: plain pointers, Strided or Member
+    template <auto L, typename T, typename...Ins, typename...Outs, size_t...Is, size_t...Ks>
+    inline void Batch(size_t n, 
+        const std::tuple<Ins...>& p, const std::tuple<Outs...>& o,
+        std::index_sequence<Is...>, std::index_sequence<Ks...>)
+    {
+        constexpr size_t W = Lanes<T>;
+
+        const auto row = [&](size_t l)
+        {
+            const auto v = L(std::make_tuple(T(std::get<Is>(p)[l])...));
+            ((std::get<Ks>(o)[l] = lane_at<Ks>(v)), ...);
+        };
+
+        const auto prefetch = [&](size_t l)
+        {
+            ([&](const auto& in) 
+            { if constexpr (requires { in.prefetch(l); }) in.prefetch(l); }
+            (std::get<Is>(p)), ...);
+        };
+
+        size_t i = 0;
+        for (; i + W <= n; i += W)
+        {
+            if (i + W + EVAL_PREFETCH_ROWS < n) prefetch(i + EVAL_PREFETCH_ROWS);
+
+            #pragma omp simd simdlen(W)
+            for (size_t l = i; l < i + W; ++l) row(l);
+        }
+
+        for (; i < n; ++i) row(i);
+    };
+
+    template <auto L, typename T, size_t N, size_t K, size_t...Is, size_t...Ks>
+    inline void Batch(
+        const std::array<std::span<const T>, N>& in, 
+        const std::array<std::span<T>, K>& out, 
+        std::index_sequence<Is...> is, std::index_sequence<Ks...> ks)
+    {
+        const size_t n = out[0].size();
+        assert(((in[Is].size() >= n) && ...));
+        assert(((out[Ks].size() >= n) && ...));
+
+        Batch<L, T>(n, std::tuple{ in[Is].data()... }, std::tuple{ out[Ks].data()... }, is, ks);
+    };
+}
+
+
+
+// Expression builder
+#include <string_view>
+
+template <const_string S, typename T = double, Optimize O = Optimize{}, 
+    string_c Expr = decltype(make_str_t<S>())> 
+struct Eval
+{
+protected: 
+    static inline constexpr std::string_view s_name = Expr::value;
+
+    using s_lex = decltype(Tokenize::gen_tokens<Expr>());
+    static inline constexpr auto s_ast = optimize<parse<Expr>(s_lex{}), O, typename ast::Scalar<T>::type>();
+    using s_tree = typename decltype(
+        lower<s_ast, O.math>(std::make_index_sequence<s_ast.size>{}))::type;
+    static inline constexpr auto s_lambda = get_as_lambda<s_tree, T>(s_lex{});
+
+public:
+    using value_type = T;
+    static inline constexpr size_t arity = s_lex::Vars::count();
+    static inline constexpr size_t node_count = s_ast.size;
+
+    template <typename...TT>
+    constexpr T operator()(TT&&...tt) const
+    {
+        return s_lambda(std::make_tuple<TT&&...>(static_cast<TT&&>(tt)...));
+    };
+
+    // Differentiation runs in double whatever the element type
+    template <ast::Ad_mode M = ast::Ad_mode::automatic, typename...TT>
+        requires (sizeof...(TT) == arity)
+    constexpr ast::Gradient<arity> gradient(TT&&...tt) const
+    {
+        return s_tree::template gradient<M>(
+            std::array<double, arity>{ static_cast<double>(tt)... });
+    };
+
+    // Caches every slot, update(var, value) then recomputes only what depends on var
+    template <typename...TT>
+        requires (sizeof...(TT) == arity)
+    constexpr auto incremental(TT&&...tt) const
+    {
+        return make_incremental<s_tree, T>(s_lex{}, 
+            std::array<T, arity>{ static_cast<T>(tt)... });
+    };
+
+    // One input column per variable, in order of first appearance
+    void eval_batch(
+        const std::array<std::span<const T>, arity>& in, 
+        std::span<T> out) const
+    {
+        meta::Batch<s_lambda>(in, std::array{ out }, 
+            std::make_index_sequence<arity>{}, std::index_sequence<0>{});
+    };
+
+    // Byte offset and stride per variable, reads records in place
+    void eval_strided(
+        const std::array<Strided<T>, arity>& in, 
+        std::span<T> out) const
+    {
+        [&]<size_t...Is>(std::index_sequence<Is...> is)
+        {
+            meta::Batch<s_lambda, T>(out.size(), std::tuple{ in[Is]... }, 
+                std::tuple{ out.data() }, is, std::index_sequence<0>{});
+        }
+        (std::make_index_sequence<arity>{});
+    };
+
+    // One Bind<var, &Rec::member> per variable, in any order
+    template <typename...Bs, typename Rec>
+    void eval_records(std::span<const Rec> in, std::span<T> out) const
+    {
+        static_assert(sizeof...(Bs) == arity, "every variable needs one binding");
+        assert(in.size() >= out.size());
+
+        constexpr auto binding = [](char v)
+        {
+            constexpr char bound[] = { Bs::var... };
+            return size_t(std::find(bound, bound + arity, v) - bound);
+        };
+
+        using binds = meta::Type_list<Bs...>;
+        [&]<size_t...Is>(std::index_sequence<Is...> is)
+        {
+            static_assert(((binding(decltype(s_lex::Vars::template get<Is>())::type::tok) 
+                < arity) && ...), "variable without a binding");
+
+            meta::Batch<s_lambda, T>(out.size(), 
+                std::tuple{ meta::Member<decltype(binds::template get<
+                    binding(decltype(s_lex::Vars::template get<Is>())::type::tok)>())::type::member, 
+                    Rec>{ in.data() }... },
+                std::tuple{ out.data() }, is, std::index_sequence<0>{});
+        }
+        (std::make_index_sequence<arity>{});
+    };
+
+    std::string_view name() const { return Eval::s_name; }
+};
+
+// Several expressions over one merged variable dictionary, evaluated in one pass.
+// Eval_set_of takes the element type and options first, as the expressions are a pack
+template <typename T, Optimize O, const_string...SS>
+struct Eval_set_of
+{
+protected:
+    using s_lex = decltype(Tokenize::gen_tokens<decltype(make_str_t<SS>())...>());
+    static inline constexpr auto s_set = optimize_set<O, typename ast::Scalar<T>::type, 
+        parse<decltype(make_str_t<SS>())>(s_lex{})...>();
+    using s_tree = typename decltype(
+        lower<s_set.ast, O.math>(std::make_index_sequence<s_set.ast.size>{}))::type;
+    static inline constexpr auto s_lambda = 
+        []<size_t...Ks>(std::index_sequence<Ks...>) 
+        { return get_as_lambda<s_tree, T, s_set.roots[Ks]...>(s_lex{}); }
+        (std::index_sequence_for<decltype(SS)...>{});
+
+public:
+    using value_type = T;
+    static inline constexpr size_t arity = s_lex::Vars::count();
+    static inline constexpr size_t count = sizeof...(SS);
+    static inline constexpr size_t node_count = s_set.ast.size;
+
+    template <typename...TT>
+    constexpr std::array<T, count> operator()(TT&&...tt) const
+    {
+        return s_lambda(std::make_tuple<TT&&...>(static_cast<TT&&>(tt)...));
+    };
+
+    // One input column per merged variable, one output column per expression
+    void eval_batch(
+        const std::array<std::span<const T>, arity>& in, 
+        const std::array<std::span<T>, count>& out) const
+    {
+        meta::Batch<s_lambda>(in, out, 
+            std::make_index_sequence<arity>{}, std::make_index_sequence<count>{});
+    };
+};
+
+template <const_string...SS>
+using Eval_set = Eval_set_of<double, Optimize{}, SS...>;
+
+// Runtime expression engine : register bytecode on a token-threaded interpreter
+// (computed goto where the compiler has labels as values, a call loop elsewhere)
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+
+namespace vm
+{
+    // Registers are AST slots, only BINARY and CALL nodes emit code
+    struct Instr
+    {
+        uint16_t op;
+        uint16_t dst;
+        uint16_t a;
+        uint16_t b;
+    };
+
+    using Scalar_fn = void (*)(double* r, const Instr* ip);
+    using Block_fn = void (*)(double* const* r, const Instr* ip, size_t n);
+
+    // One opcode per Operator_table entry, then one per Function_table entry
+    // at each accuracy, then HALT
+    static inline constexpr uint16_t FUNCTIONS = Operator_table::count();
+    static inline constexpr uint16_t HALT = FUNCTIONS + 2 * Fn_infos.size();
+
+    struct Dispatch
+    {
+        static const std::array<Scalar_fn, HALT + 1> scalar;
+        static const std::array<Block_fn, HALT + 1> block;
+    };
+
+    // Each handler runs one instruction, run() threads them together
+    template <char Op>
+    inline void scalar_op(double* r, const Instr* ip)
+    {
+        r[ip->dst] = Token<Op>::expr(r[ip->a], r[ip->b]);
+    };
+
+    template <char Op>
+    inline void block_op(double* const* r, const Instr* ip, size_t n)
+    {
+        double* const d = r[ip->dst];
+        const double* const a = r[ip->a];
+        const double* const b = r[ip->b];
+
+        #pragma omp simd
+        for (size_t i = 0; i < n; ++i) d[i] = Token<Op>::expr(a[i], b[i]);
+    };
+
+    template <Fn F, vmath::Accuracy A>
+    inline void scalar_call(double* r, const Instr* ip)
+    {
+        if constexpr (Function<F>::arity == 1) r[ip->dst] = Function<F>::template expr<A>(r[ip->a]);
+        else r[ip->dst] = Function<F>::template expr<A>(r[ip->a], r[ip->b]);
+    };
+
+    template <Fn F, vmath::Accuracy A>
+    inline void block_call(double* const* r, const Instr* ip, size_t n)
+    {
+        double* const d = r[ip->dst];
+        const double* const a = r[ip->a];
+        const double* const b = r[ip->b];
+
+        if constexpr (Function<F>::arity == 1)
+        {
+            #pragma omp simd
+            for (size_t i = 0; i < n; ++i) d[i] = Function<F>::template expr<A>(a[i]);
+        }
+        else
+        {
+            #pragma omp simd
+            for (size_t i = 0; i < n; ++i) d[i] = Function<F>::template expr<A>(a[i], b[i]);
+        }
+    };
+
+    inline void scalar_halt(double*, const Instr*) {};
+    inline void block_halt(double* const*, const Instr*, size_t) {};
+
+    using vmath::Accuracy;
+
+    template <char...OO, Fn...FF>
+    consteval inline auto scalar_table(meta::Type_list<Token<OO>...>, Function_list<FF...>)
+    {
+        return std::array<Scalar_fn, HALT + 1>{ &scalar_op<OO>..., 
+            &scalar_call<FF, Accuracy::precise>..., &scalar_call<FF, Accuracy::fast>..., &scalar_halt };
+    };
+
+    template <char...OO, Fn...FF>
+    consteval inline auto block_table(meta::Type_list<Token<OO>...>, Function_list<FF...>)
+    {
+        return std::array<Block_fn, HALT + 1>{ &block_op<OO>..., 
+            &block_call<FF, Accuracy::precise>..., &block_call<FF, Accuracy::fast>..., &block_halt };
+    };
+
+    inline constexpr std::array<Scalar_fn, HALT + 1> 
+        Dispatch::scalar = scalar_table(Operator_table{}, Function_table{});
+    inline constexpr std::array<Block_fn, HALT + 1> 
+        Dispatch::block = block_table(Operator_table{}, Function_table{});
+
+    // Opcode labels in table order, for compilers with labels as values
+#define EXPRESSION_COMPILER_OPS(X) X(add, '+') X(sub, '-') X(mul, '*') X(div, '/') X(mod, '%') X(pow, '^')
+#define EXPRESSION_COMPILER_FNS(X, A) X(NEG, A) X(SQRT, A) X(EXP, A) X(LOG, A) X(ABS, A) X(MIN, A) X(MAX, A)
+
+    template <char...OO>
+    consteval inline auto op_chars(meta::Type_list<Token<OO>...>) { return std::array{ OO... }; };
+
+    template <Fn...FF>
+    consteval inline auto fn_ids(Function_list<FF...>) { return std::array{ FF... }; };
+
+#define EXPRESSION_COMPILER_OP_CHAR(name, c) c,
+#define EXPRESSION_COMPILER_FN_ID(f, A) Fn::f,
+    static_assert(std::array{ EXPRESSION_COMPILER_OPS(EXPRESSION_COMPILER_OP_CHAR) } 
+        == op_chars(Operator_table{}), "operator labels out of Operator_table order");
+    static_assert(std::array{ EXPRESSION_COMPILER_FNS(EXPRESSION_COMPILER_FN_ID, precise) } 
+        == fn_ids(Function_table{}), "function labels out of Function_table order");
+
+    // Token threading : every handler site ends in its own indirect jump to
+    // the next opcode's label, so each opcode keeps its own branch history.
+    // Without labels as values a loop calls through the handler tables
+    template <typename R>
+    inline void threaded(R r, const Instr* ip, size_t n)
+    {
+        constexpr bool block = std::is_same_v<R, double* const*>;
+#if defined(__GNUC__)
+#define EXPRESSION_COMPILER_OP_LABEL(name, c) &&op_##name,
+#define EXPRESSION_COMPILER_FN_LABEL(f, A) &&A##_##f,
+#define EXPRESSION_COMPILER_OP_CASE(name, c) op_##name: \
+        if constexpr (block) block_op<c>(r, ip, n); else scalar_op<c>(r, ip); \
+        ++ip; goto *labels[ip->op];
+#define EXPRESSION_COMPILER_FN_CASE(f, A) A##_##f: \
+        if constexpr (block) block_call<Fn::f, Accuracy::A>(r, ip, n); \
+        else scalar_call<Fn::f, Accuracy::A>(r, ip); \
+        ++ip; goto *labels[ip->op];
+
+        static const void* const labels[] = {
+            EXPRESSION_COMPILER_OPS(EXPRESSION_COMPILER_OP_LABEL)
+            EXPRESSION_COMPILER_FNS(EXPRESSION_COMPILER_FN_LABEL, precise)
+            EXPRESSION_COMPILER_FNS(EXPRESSION_COMPILER_FN_LABEL, fast)
+            &&halt };
+        static_assert(std::size(labels) == HALT + 1, "one label per opcode");
+
+        goto *labels[ip->op];
+        EXPRESSION_COMPILER_OPS(EXPRESSION_COMPILER_OP_CASE)
+        EXPRESSION_COMPILER_FNS(EXPRESSION_COMPILER_FN_CASE, precise)
+        EXPRESSION_COMPILER_FNS(EXPRESSION_COMPILER_FN_CASE, fast)
+    halt:
+        return;
+
+#undef EXPRESSION_COMPILER_OP_LABEL
+#undef EXPRESSION_COMPILER_FN_LABEL
+#undef EXPRESSION_COMPILER_OP_CASE
+#undef EXPRESSION_COMPILER_FN_CASE
+#else
+        for (; ip->op != HALT; ++ip)
+            if constexpr (block) Dispatch::block[ip->op](r, ip, n);
+            else Dispatch::scalar[ip->op](r, ip);
+#endif
+    };
+
+    inline void run(double* r, const Instr* ip) { threaded(r, ip, 0); };
+    inline void run(double* const* r, const Instr* ip, size_t n) { threaded(r, ip, n); };
+
+#undef EXPRESSION_COMPILER_OP_CHAR
+#undef EXPRESSION_COMPILER_FN_ID
+#undef EXPRESSION_COMPILER_OPS
+#undef EXPRESSION_COMPILER_FNS
+
+    template <char...OO>
+    constexpr inline uint16_t opcode(char c, meta::Type_list<Token<OO>...>)
+    {
+        uint16_t i = 0;
+        ((c != OO && ++i) && ...);
+        return i;
+    };
+
+    constexpr inline uint16_t opcode(Fn f, Accuracy a)
+    { return FUNCTIONS + (a == Accuracy::fast ? Fn_infos.size() : 0) + size_t(f); };
+}
+
+// Runtime counterpart of Eval for expressions that are only known at startup
+class Runtime_eval
+{
+    static inline constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    std::string d_name;
+    std::string d_vars;
+    std::vector<double> d_init;      // register file with constants preloaded
+    std::vector<size_t> d_var_slot;  // register of each variable or npos
+    std::vector<vm::Instr> d_code;
+    size_t d_root;
+
+    static std::string collect_vars(std::string_view src)
+    {
+        std::string vars;
+        for (size_t p = 0; p < src.size(); ++p)
+        {
+            if (const size_t n = name_length(src, p); n > 1) p += n - 1;
+            else if (token_kind(src[p]) == Token_vs::VARIABLE && vars.find(src[p]) == std::string::npos)
+                vars += src[p];
+        }
+        return vars;
+    };
+
+public:
+    static inline constexpr size_t block = 128;
+
+    explicit Runtime_eval(std::string_view src, Optimize opt = {})
+        : d_name(src), d_vars(collect_vars(src))
+    {
+        ast::Node_list parsed;
+        Parser{ src, d_vars, parsed }.run();
+        const ast::Node_list a = ast::optimize(parsed, opt);
+
+        if (a.size > std::numeric_limits<uint16_t>::max())
+            throw std::length_error("expression exceeds the register file");
+
+        d_init.assign(a.size, 0.0);
+        d_var_slot.assign(d_vars.size(), npos);
+        for (size_t i = 0; i < a.size; ++i)
+        {
+            const ast::Node& n = a.nodes[i];
+            switch (n.kind)
+            {
+            case ast::CONST: d_init[i] = n.value; break;
+            case ast::VAR: d_var_slot[n.lhs] = i; break;
+            case ast::BINARY:
+                d_code.push_back({ vm::opcode(n.op, Operator_table{}), 
+                    uint16_t(i), uint16_t(n.lhs), uint16_t(n.rhs) });
+                break;
+            case ast::CALL:
+                d_code.push_back({ vm::opcode(Fn(n.op), opt.math), 
+                    uint16_t(i), uint16_t(n.lhs), uint16_t(n.rhs) });
+                break;
+            }
+        }
+        d_code.push_back({ vm::HALT, 0, 0, 0 });
+        d_root = a.root();
+    };
+
+    size_t arity() const { return d_vars.size(); }
+    std::string_view vars() const { return d_vars; }
+    std::string_view name() const { return d_name; }
+
+    double eval(std::span<const double> args) const
+    {
+        if (args.size() != arity())
+            throw std::invalid_argument("wrong number of arguments");
+
+        double stack[64];
+        std::vector<double> heap;
+        double* const r = d_init.size() <= 64 ? stack : (heap.resize(d_init.size()), heap.data());
+
+        std::copy(d_init.begin(), d_init.end(), r);
+        for (size_t v = 0; v < args.size(); ++v)
+            if (d_var_slot[v] != npos) r[d_var_slot[v]] = args[v];
+
+        vm::run(r, d_code.data());
+        return r[d_root];
+    };
+
+    template <typename...TT>
+        requires (std::convertible_to<TT, double> && ...)
+    double operator()(TT...tt) const
+    {
+        const double args[] = { static_cast<double>(tt)..., 0.0 };
+        return eval({ args, sizeof...(TT) });
+    };
+
+    // Each instruction runs over a block of rows, inputs and the output
+    // are addressed in place so only temporaries live in scratch
+    void eval_batch(std::span<const std::span<const double>> in, std::span<double> out) const
+    {
+        if (in.size() != arity())
+            throw std::invalid_argument("wrong number of input columns");
+        const size_t n = out.size();
+
+        std::vector<double> scratch(d_init.size() * block);
+        std::vector<double*> r(d_init.size());
+        for (size_t i = 0; i < r.size(); ++i)
+        {
+            r[i] = scratch.data() + i * block;
+            std::fill_n(r[i], block, d_init[i]);
+        }
+
+        const bool root_computed = d_code.size() > 1 && d_code[d_code.size() - 2].dst == d_root;
+        for (size_t row = 0; row < n; row += block)
+        {
+            const size_t m = std::min(block, n - row);
+            for (size_t v = 0; v < in.size(); ++v)
+            {
+                assert(in[v].size() >= n);
+                if (d_var_slot[v] != npos) 
+                    r[d_var_slot[v]] = const_cast<double*>(in[v].data() + row);  // never written
+            }
+
+            if (root_computed) r[d_root] = out.data() + row;
+            vm::run(r.data(), d_code.data(), m);
+            if (not root_computed) std::copy_n(r[d_root], m, out.data() + row);
+        }
+    };
+
+    void eval_batch(std::initializer_list<std::span<const double>> in, std::span<double> out) const
+    { eval_batch(std::span<const std::span<const double>>{ in.begin(), in.size() }, out); };
+};
+
+
+
+#ifndef EXPRESSION_COMPILER_NO_MAIN
+#include <iostream>
+#include <vector>
+#if __has_include(<experimental/simd>)
+#include <experimental/simd>
+#endif
+
+int main()
+{
+    constexpr double d = Eval<"a - b * c / d">{}(1.0, 2.0, 7.0, 3.9);
+    std::cout << d << std::endl;
+
+    static_assert(Eval<"(a - b) * c / d">{}(1.0, 2.0, 7.0, 4.0) == -1.75);
+    static_assert(Eval<"a ^ b ^ c">{}(2.0, 3.0, 2.0) == 512.0);
+    static_assert(Eval<"a - b - c">{}(1.0, 2.0, 3.0) == -4.0);
+
+    static_assert(Eval<"x ^ 3 + 2 * 4.5">{}(2.0) == 17.0);
+    static_assert(Eval<"a * b + b * a">::node_count == 4);
+    static_assert(Eval<"a / 4", double, Optimize{ .reciprocal_div = true }>{}(3.0) == 0.75);
+
+    using ast::Ad_mode;
+    constexpr auto grad = Eval<"a * b + a ^ 3 / b">{};
+    static_assert(grad.gradient(2.0, 4.0).value == 10.0);
+    static_assert(grad.gradient<Ad_mode::forward>(2.0, 4.0).partials == std::array{ 7.0, 1.5 });
+    static_assert(grad.gradient<Ad_mode::reverse>(2.0, 4.0).partials == std::array{ 7.0, 1.5 });
+
+    auto e = Eval<"g ^ b">{};
+    std::cout << e(3.1, 4.7) << std::endl;
+
+    constexpr auto f = Eval<"a * b + c">{};
+    std::vector<double> a(1003), b(1003), c(1003), out(1003);
+    for (size_t i = 0; i < out.size(); ++i) 
+    { a[i] = i; b[i] = 0.5; c[i] = 1.0; }
+
+    f.eval_batch({a, b, c}, out);
+    for (size_t i = 0; i < out.size(); ++i) assert(out[i] == f(a[i], b[i], c[i]));
+    std::cout << out.back() << std::endl;
+
+    const Runtime_eval r{ "a - b * c / d" };
+    assert(r(1.0, 2.0, 7.0, 3.9) == d);
+
+    const Runtime_eval g{ "a * b + c" };
+    std::vector<double> out_rt(out.size());
+    g.eval_batch({a, b, c}, out_rt);
+    assert(out_rt == out);
+
+    const auto rejects = [](auto&& call)
+    {
+        try { call(); } catch (const std::invalid_argument&) { return true; }
+        return false;
+    };
+    assert(rejects([&] { g(1.0, 2.0); }) && rejects([&] { g.eval_batch({a, b}, out_rt); }));
+
+    constexpr auto set = Eval_set<"a * b", "a * b + c", "a / b">{};
+    static_assert(set.node_count == 6);
+    static_assert(set(6.0, 3.0, 1.0) == std::array{ 18.0, 19.0, 2.0 });
+
+    std::vector<double> o0(out.size()), o1(out.size()), o2(out.size());
+    set.eval_batch({a, b, c}, {o0, o1, o2});
+    assert(o1 == out);
+
+    static_assert(Eval<"a % b + c ^ 3", int64_t>{}(7, 4, 2) == 11);
+    static_assert(Eval<"a ^ 99999999999999999999999">{}(1.0) == 1.0);
+    static_assert(Eval<"a * 2 + a * (1 + 1)">::node_count == 4 && Eval<"a * 2.0 + a * 2">::node_count == 4);
+    static_assert(Eval<"a ^ 100", double, Optimize{ .max_pow = 1000 }>{}.node_count == 3);
+    static_assert(Eval<"7 / 2 * 2 + a", int64_t>{}(0) == Eval<"a / 2 * 2", int64_t>{}(7));
+    static_assert(Eval<"a / 2", int64_t, Optimize{ .reciprocal_div = true }>{}(7) == 3);
+    static_assert(Eval<"a % b", float>{}(7.5f, 2.0f) == 1.5f);
+    static_assert(Eval_set_of<int64_t, Optimize{}, "a / 2", "a % 2 + 7 / 2">{}(7) 
+        == std::array<int64_t, 2>{ 3, 4 });
+
+    std::vector<float> af(a.begin(), a.end()), bf(b.begin(), b.end()), cf(c.begin(), c.end());
+    std::vector<float> outf(out.size());
+    Eval<"a * b + c", float>{}.eval_batch({af, bf, cf}, outf);
+    assert(outf.back() == float(out.back()));
+
+    std::vector<float> o1f(out.size()), o2f(out.size());
+    Eval_set_of<float, Optimize{}, "a * b + c", "a / b">{}.eval_batch({af, bf, cf}, {o1f, o2f});
+    assert(o1f == outf);
+
+    struct Quote { double bid; float size; double ask; };
+    std::vector<Quote> quotes(out.size());
+    for (size_t i = 0; i < quotes.size(); ++i) quotes[i] = { a[i], 1.f, a[i] + b[i] };
+
+    constexpr auto mid = Eval<"(b + a) / 2">{};
+    std::vector<double> out_aos(out.size()), out_strided(out.size());
+    mid.eval_records<Bind<'a', &Quote::ask>, Bind<'b', &Quote::bid>>(std::span<const Quote>(quotes), out_aos);
+
+    const auto* bytes = reinterpret_cast<const std::byte*>(quotes.data());
+    mid.eval_strided({ Strided<double>{ bytes + offsetof(Quote, bid), sizeof(Quote) },
+                       Strided<double>{ bytes + offsetof(Quote, ask), sizeof(Quote) } }, out_strided);
+    assert(out_aos == out_strided && out_aos[2] == mid(quotes[2].bid, quotes[2].ask));
+
+    #pragma pack(push, 1)
+    struct Tick { char venue; double bid; double ask; };
+    #pragma pack(pop)
+    std::vector<Tick> ticks(out.size());
+    for (size_t i = 0; i < ticks.size(); ++i) ticks[i] = { 'X', quotes[i].bid, quotes[i].ask };
+    const auto* packed = reinterpret_cast<const std::byte*>(ticks.data());
+    mid.eval_strided({ Strided<double>{ packed + offsetof(Tick, bid), sizeof(Tick) },
+                       Strided<double>{ packed + offsetof(Tick, ask), sizeof(Tick) } }, out_strided);
+    assert(out_aos == out_strided);
+
+    static_assert([]
+    {
+        auto tick = Eval<"p * q + (r - s) * s">{}.incremental(2.0, 3.0, 5.0, 1.0);
+        tick.update<'p'>(4.0);
+        return tick.update('s', 2.0) == 18.0 && tick.value() == Eval<"p * q + (r - s) * s">{}(4.0, 3.0, 5.0, 2.0);
+    }());
+
+    static_assert(Eval<"-a ^ 2 + sqrt(b)">{}(3.0, 16.0) == -5.0);
+    static_assert(Eval<"max(a, b) - min(b, a) + abs(-a)">{}(3.0, 7.0) == 7.0);
+    static_assert(not std::signbit(Eval<"abs(a)">{}(-0.0)));
+    assert(Eval<"1 / abs(a)">{}(-0.0) > 0 && Runtime_eval{ "1 / abs(a)" }(-0.0) > 0);
+    static_assert(Eval<"a - -b">::node_count == 3);
+    static_assert(Eval<"exp(a) * b + max(a, b)">{}.gradient(0.0, 2.0).partials == std::array{ 2.0, 2.0 });
+    static_assert(Eval<"a % b">{}.gradient(7.5, 2.0).partials == std::array{ 1.0, -3.0 });
+
+    constexpr double ln10 = Eval<"log(a)">{}(10.0);
+    assert(std::abs(ln10 - std::log(10.0)) < 1e-15 && std::abs(Eval<"exp(a)">{}(ln10) - 10.0) < 1e-14);
+
+    using vmath::Accuracy;
+    constexpr auto fast = Eval<"exp(a) * -b + max(a, sqrt(b))", double, Optimize{ .math = Accuracy::fast }>{};
+    const Runtime_eval fast_rt{ "exp(a) * -b + max(a, sqrt(b))", Optimize{ .math = Accuracy::fast } };
+    std::vector<double> out_fast(out.size()), out_fast_rt(out.size());
+    fast.eval_batch({a, b}, out_fast);
+    fast_rt.eval_batch({a, b}, out_fast_rt);
+    assert(out_fast == out_fast_rt && out_fast[5] == fast(a[5], b[5]));
+
+    // The polynomials against libm, from the subnormal range to near overflow
+    const auto ulps = []<typename F>(F got, F want)
+    {
+        const F gap = std::nextafter(std::abs(want), std::numeric_limits<F>::infinity()) - std::abs(want);
+        return got == want ? 0.0 : std::abs(double(got) - double(want)) / double(gap);
+    };
+    const auto within_ulp = [&]<typename F>(F lo, F hi)
+    {
+        constexpr int steps = 1 << 18;
+        double worst = 0;
+        for (int i = 0; i <= steps; ++i)
+        {
+            const F x = lo + (hi - lo) * F(i) / F(steps), y = std::exp2(x);
+            worst = std::max({ worst, ulps(vmath::exp<Accuracy::fast>(x), std::exp(x)),
+                ulps(vmath::log<Accuracy::fast>(y), std::log(y)), 
+                ulps(vmath::sqrt<Accuracy::fast>(y), std::sqrt(y)) });
+        }
+        return worst <= 1.0;
+    };
+    assert(within_ulp(-740.0, 709.0) && within_ulp(-1.0, 1.0));
+    assert(within_ulp(-103.0f, 88.0f) && within_ulp(-1.0f, 1.0f));
+
+#if __has_include(<experimental/simd>)
+    using lanes = std::experimental::native_simd<float>;
+    const lanes v = Eval<"a * b + c ^ 2", lanes>{}(lanes(2.f), lanes(3.f), lanes(1.f));
+    assert(v[lanes::size() - 1] == 7.f);
+#endif
 }
+#endif
 
 //Compiler GCC12.2 
-//Flags -std=c++2b -O3
+//Flags -std=c++2b -O3 -march=native -fopenmp-simd